@@ -32,6 +32,21 @@ void ArUcoMarker::EstimatePoseSingleMarkers(cv::InputArray cameraMatrix, cv::Inp
 	cv::aruco::estimatePoseSingleMarkers(corners, Size(), cameraMatrix, distCoeffs, rvecs, tvecs);
 }
 
+bool ArUcoMarker::GetPose(cv::Vec3d& rvec, cv::Vec3d& tvec)
+{
+	for (int idx = 0; idx < rvecs.size() && idx < ids.size(); ++idx)
+	{
+		if (ids[idx] == ID())
+		{
+			rvec = rvecs[idx];
+			tvec = tvecs[idx];
+			return true;
+		}
+	}
+
+	return false;
+}
+
 void ArUcoMarker::DrawDetectedMarkers(cv::InputArray src, cv::OutputArray dst)
 {
 	cv::Mat tmp; src.copyTo(tmp);
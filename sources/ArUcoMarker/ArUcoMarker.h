@@ -13,6 +13,7 @@ public:
 	void DetectMarkers(cv::InputArray image);
 	void GetCorners(cv::OutputArray corners);
 	void EstimatePoseSingleMarkers(cv::InputArray cameraMatrix, cv::InputArray distCoeffs);
+	bool GetPose(cv::Vec3d& rvec, cv::Vec3d& tvec);	// false when the marker was not found
 
 	void DrawDetectedMarkers(cv::InputArray src, cv::OutputArray dst);
 	void DrawAxis(cv::InputArray src, cv::OutputArray dst, cv::InputArray cameraMatrix, cv::InputArray distCoeffs, float axisLength);
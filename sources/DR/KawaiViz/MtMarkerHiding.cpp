@@ -36,26 +36,50 @@ namespace dr
 	{
 	}
 
-	void MtMarkerHiding::Run(cv::InputArray color, cv::InputArray corners, cv::OutputArray inpainted, const det::PixMixParams& params)
+	void MtMarkerHiding::Run(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params)
 	{
-		if (corners.cols() != markerCorners.size()) return;
+		if (!Rectify(color, corners)) return;
+
+		// start multi-threading
+		pm.MtRun(ipColor, ipMask, params);
+	}
+
+	void MtMarkerHiding::BeginSteps(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params)
+	{
+		if (!Rectify(color, corners)) return;
+
+		pm.BeginSteps(ipColor, ipMask, params);
+	}
+
+	bool MtMarkerHiding::Step(std::chrono::microseconds budget)
+	{
+		return pm.Step(budget);
+	}
+
+	bool MtMarkerHiding::Rectify(cv::InputArray color, cv::InputArray corners)
+	{
+		if (corners.cols() != markerCorners.size()) return false;
 
 		// warp
 		auto H = cv::findHomography(corners, markerCorners);
 		cv::warpPerspective(color, ipColor, H, ipColor.size());
 
 		dr::util::CreateMaskFromCorners(roiCorners, ipColor.size(), ipMask);
-
-		// start multi-threading
-		pm.MtRun(ipColor, ipMask, inpainted, params);
+		return true;
 	}
 
 	bool MtMarkerHiding::GetIntermidColor(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners)
 	{
 		if (corners.cols() != markerCorners.size()) return false;
 
-		cv::Mat intermidColor;
-		if (!pm.GetIntermidColor(intermidColor)) return false;
+		// fetch only when PixMix has published something new
+		const auto generation = pm.GetIntermidGeneration();
+		if (generation != intermidGeneration)
+		{
+			if (!pm.GetIntermidColor(intermidColor)) return false;
+			intermidGeneration = generation;
+		}
+		if (intermidColor.empty()) return false;
 
 		if (debugViz)
 		{
@@ -65,7 +89,8 @@ namespace dr
 
 		// warp back
 		auto H = cv::findHomography(markerCorners, corners);
-		cv::warpPerspective(intermidColor, intermidColor, H, color.size());
+		cv::Mat warpedColor;
+		cv::warpPerspective(intermidColor, warpedColor, H, color.size());
 
 		// composition (Poisson seamless cloning)
 		std::vector<cv::Point2f> transRoiCornersF;
@@ -80,7 +105,7 @@ namespace dr
 		cv::Point center(0, 0);
 		for (const auto& pt : transRoiCornersI) center += pt;
 		center = center / int(transRoiCornersI.size());
-		cv::seamlessClone(intermidColor, color, mask, center, inpainted, cv::NORMAL_CLONE);
+		cv::seamlessClone(warpedColor, color, mask, center, inpainted, cv::NORMAL_CLONE);
 
 		return true;
 	}
@@ -14,7 +14,10 @@ namespace dr
 		MtMarkerHiding(const Marker& marker, int markerSizeInPx, int maxIpImageSize, bool debugViz);
 		~MtMarkerHiding();
 
-		void Run(cv::InputArray color, cv::InputArray corners, cv::OutputArray inpainted, const det::PixMixParams& params);
+		void Run(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params);	// the result comes through GetIntermidColor
+		// time-sliced alternative to Run without the background thread: Step gets a slice of every frame
+		void BeginSteps(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params);
+		bool Step(std::chrono::microseconds budget);	// true once the result is complete
 		bool GetIntermidColor(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners);
 		void Stop();
 		bool IsDone();
@@ -22,7 +25,8 @@ namespace dr
 	private:
 		PixMix pm;
 		std::thread th;
-		cv::Mat intermidColor;
+		cv::Mat intermidColor;			// the last fetched intermediate result of pm
+		uint64_t intermidGeneration = 0;	// its PixMix::GetIntermidGeneration
 
 		cv::Mat ipColor, ipMask;
 		std::vector<cv::Point2i> markerCorners;
@@ -31,5 +35,7 @@ namespace dr
 		cv::Rect markerRect, roiRect;
 
 		bool debugViz;
+
+		bool Rectify(cv::InputArray color, cv::InputArray corners);	// into ipColor and ipMask
 	};
 }
\ No newline at end of file
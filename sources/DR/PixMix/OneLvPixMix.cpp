@@ -1,69 +1,621 @@
 #include "DR/PixMix/OneLvPixMix.h"
 
+#include <climits>
+#include <opencv2/core/hal/intrin.hpp>
+
 namespace dr
 {
 	namespace det
 	{
-		OneLvPixMix::OneLvPixMix()
-			: borderSize(2), borderSizePosMap(1), windowSize(5), toLeft(0, -1), toRight(0, 1), toUp(-1, 0), toDown(1, 0)
+		namespace
 		{
-			vSptAdj = {
-				cv::Vec2i(-1, -1), cv::Vec2i(-1, 0), cv::Vec2i(-1, 1),
-				cv::Vec2i(0, -1),                   cv::Vec2i(0, 1),
-				cv::Vec2i(1, -1), cv::Vec2i(1, 0), cv::Vec2i(1, 1)
+			const int sptAdj[8][2] = {
+				{ -1, -1 }, { -1, 0 }, { -1, 1 },
+				{ 0, -1 },             { 0, 1 },
+				{ 1, -1 }, { 1, 0 }, { 1, 1 }
+			};
+
+#if CV_SIMD128
+			// loading at laneMask + 16 - n enables the first n lanes only
+			const uchar laneMask[32] = {
+				255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+				0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+			};
+
+			inline cv::v_uint8x16 LoadLaneMask(int n)
+			{
+				return cv::v_load(laneMask + 16 - std::min(n, 16));
+			}
+#endif
+
+			// Appearance metrics over a W x W window of packed 8-bit BGR pixels.
+			// A window row spans 3 * W bytes; the lanes past it are masked off (W <= 7 reads at most 4 pixels beyond).
+			// The sum is returned as soon as it exceeds bound after a row, i.e. possibly partial.
+			struct SsdMetric
+			{
+				static constexpr float normFactor = 255.0f * 255.0f * 3.0f;
+
+				template <int W>
+				static int Calc(const uchar* ptrTarget, const uchar* ptrRef, size_t step, int bound)
+				{
+					int ac = 0;
+					for (int r = 0; r < W && ac <= bound; ++r, ptrTarget += step, ptrRef += step)
+					{
+#if CV_SIMD128
+						cv::v_int32x4 vAc = cv::v_setzero_s32();
+						for (int c = 0; c < 3 * W; c += 16)
+						{
+							const cv::v_uint8x16 diff = cv::v_absdiff(cv::v_load(ptrTarget + c), cv::v_load(ptrRef + c)) & LoadLaneMask(3 * W - c);
+							cv::v_uint16x8 diffLo, diffHi;
+							cv::v_expand(diff, diffLo, diffHi);
+							vAc += cv::v_dotprod(cv::v_reinterpret_as_s16(diffLo), cv::v_reinterpret_as_s16(diffLo));
+							vAc += cv::v_dotprod(cv::v_reinterpret_as_s16(diffHi), cv::v_reinterpret_as_s16(diffHi));
+						}
+						ac += cv::v_reduce_sum(vAc);
+#else
+						for (int c = 0; c < 3 * W; ++c)
+						{
+							const int diff = int(ptrTarget[c]) - int(ptrRef[c]);
+							ac += diff * diff;
+						}
+#endif
+					}
+					return ac;
+				}
+			};
+
+			struct SadMetric
+			{
+				static constexpr float normFactor = 255.0f * 3.0f;
+
+				template <int W>
+				static int Calc(const uchar* ptrTarget, const uchar* ptrRef, size_t step, int bound)
+				{
+					int ac = 0;
+					for (int r = 0; r < W && ac <= bound; ++r, ptrTarget += step, ptrRef += step)
+					{
+#if CV_SIMD128
+						for (int c = 0; c < 3 * W; c += 16)
+						{
+							const cv::v_uint8x16 lanes = LoadLaneMask(3 * W - c);
+							ac += int(cv::v_reduce_sad(cv::v_load(ptrTarget + c) & lanes, cv::v_load(ptrRef + c) & lanes));
+						}
+#else
+						for (int c = 0; c < 3 * W; ++c) ac += std::abs(int(ptrTarget[c]) - int(ptrRef[c]));
+#endif
+					}
+					return ac;
+				}
 			};
+
+			struct LumaMetric
+			{
+				static constexpr float normFactor = 255.0f * 255.0f;
+
+				template <int W>
+				static int Calc(const uchar* ptrTarget, const uchar* ptrRef, size_t step, int bound)
+				{
+					// BT.601 luma in 8-bit fixed point (29, 150, 77 for B, G, R)
+					int ac = 0;
+					for (int r = 0; r < W && ac <= bound; ++r, ptrTarget += step, ptrRef += step)
+					{
+						for (int c = 0; c < 3 * W; c += 3)
+						{
+							const int diff = (29 * (int(ptrTarget[c]) - int(ptrRef[c])) + 150 * (int(ptrTarget[c + 1]) - int(ptrRef[c + 1])) + 77 * (int(ptrTarget[c + 2]) - int(ptrRef[c + 2]))) / 256;
+							ac += diff * diff;
+						}
+					}
+					return ac;
+				}
+			};
+		}
+
+		constexpr int OneLvPixMix::borderSize;
+		constexpr int OneLvPixMix::borderSizePosMap;
+		constexpr int OneLvPixMix::simdPadding;
+		constexpr int OneLvPixMix::annWindowSize;
+
+		void DecodePosMap(cv::InputArray srcPosMap, cv::OutputArray dstPosMap)
+		{
+			srcPosMap.getMat().convertTo(dstPosMap, CV_32S);
+		}
+
+		void DecodeCostMap(cv::InputArray srcCostMap, cv::OutputArray dstCostMap)
+		{
+			srcCostMap.getMat().convertTo(dstCostMap, CV_32F, 1.0 / costScale);
+		}
+
+		OneLvPixMix::OneLvPixMix()
+			: toLeft(0, -1), toRight(0, 1), toUp(-1, 0), toDown(1, 0), sweepCount(0), numOutsideValid(0), numHolePixels(0), annMaxSamples(20000), hasCandidates(false), cancel(nullptr),
+			prepareFn(nullptr), sweepFn(nullptr), thDist(0.0f), prevCost(DBL_MAX)
+		{
 		}
 
 		OneLvPixMix::~OneLvPixMix() { }
 
-		void OneLvPixMix::Init(const cv::Mat3b& color, const cv::Mat1b& mask)
+		void OneLvPixMix::Allocate(const cv::Size& size)
 		{
-			std::random_device rnd;
-			mt = std::mt19937(rnd());
-			cRand = std::uniform_int_distribution<int>(0, color.cols - 1);
-			rRand = std::uniform_int_distribution<int>(0, color.rows - 1);
+			if (mColor[WO_BORDER].size() == size) return;
+
+			// extra columns on the right so that 16-byte loads in CalcAppCost never run past a row
+			mColor[W_BORDER] = cv::Mat3b(size.height + 2 * borderSize, size.width + 2 * borderSize + simdPadding, cv::Vec3b(0, 0, 0));
+			mColor[WO_BORDER] = cv::Mat(mColor[W_BORDER], cv::Rect(borderSize, borderSize, size.width, size.height));
+			// int16 positions; the NNF and the cost map follow the hole box (BuildMaskIndices)
+			assert(std::max(size.width, size.height) <= SHRT_MAX);
+			rowProgress.reset(new std::atomic<int>[size.height]);
+		}
+
+		void OneLvPixMix::Init(const cv::Mat3b& color, const cv::Mat1b& mask, unsigned int seed, int lv)
+		{
+			Allocate(color.size());
+			color.copyTo(mColor[WO_BORDER]);
+			SetMask(mask);
+			Init(seed, lv);
+		}
+
+		void OneLvPixMix::Init(unsigned int seed, int lv)
+		{
+			rng = Philox4x32(seed, uint32_t(lv));
+			sweepCount = 0;
+
+			util::FillReflectBorder(mColor[W_BORDER], borderSize, borderSize, borderSize, borderSize + simdPadding);
+
+			// the hole box and its border inside the level (hole pixels random, the others themselves)
+			const cv::Rect levelRect(cv::Point(0, 0), mMask[WO_BORDER].size());
+			const cv::Rect boxRect = cv::Rect(holeRect.x - borderSizePosMap, holeRect.y - borderSizePosMap, holeRect.width + 2 * borderSizePosMap, holeRect.height + 2 * borderSizePosMap) & levelRect;
+			for (int r = boxRect.y; r < boxRect.br().y; ++r)
+			{
+				for (int c = boxRect.x; c < boxRect.br().x; ++c)
+				{
+					if (mMask[WO_BORDER](r, c) == 0) PosAt(r, c) = cv::Vec2s(GetValidRandPos(rng(r, c, sweepCount, 0)));
+					else PosAt(r, c) = cv::Vec2s(short(r), short(c));
+				}
+			}
+			FillPosMapBorder();
+			mNnfStamp[W_BORDER].setTo(0);
+			mCostMap.setTo(costInvalid);
+		}
+
+		void OneLvPixMix::SetMask(const cv::Mat1b& mask)
+		{
+			// the sampling index and the hole spans survive as long as the mask stays the same
+			if (mMask[WO_BORDER].size() == mask.size() && cv::norm(mMask[WO_BORDER], mask, cv::NORM_INF) == 0.0) return;
 
-			cv::copyMakeBorder(color, mColor[W_BORDER], borderSize, borderSize, borderSize, borderSize, cv::BORDER_REFLECT);
 			cv::copyMakeBorder(mask, mMask[W_BORDER], borderSize, borderSize, borderSize, borderSize, cv::BORDER_REFLECT);
-			mColor[WO_BORDER] = cv::Mat(mColor[W_BORDER], cv::Rect(borderSize, borderSize, color.cols, color.rows));
 			mMask[WO_BORDER] = cv::Mat(mMask[W_BORDER], cv::Rect(borderSize, borderSize, mask.cols, mask.rows));
+			BuildMaskIndices();
+		}
+
+		void OneLvPixMix::SetPosMap(cv::InputArray posMap, const cv::Rect& roi)
+		{
+			assert(posMap.size() == roi.size() && posMap.type() == CV_16SC2 && (holeRect & roi) == holeRect);
+
+			ResetPosMap();
+			const cv::Rect boxRect(holeRect.x - borderSizePosMap, holeRect.y - borderSizePosMap, mPosMap[W_BORDER].cols, mPosMap[W_BORDER].rows);
+			const cv::Rect src = boxRect & roi;
+			if (src.empty()) return;
+			posMap.getMat()(src - roi.tl()).copyTo(mPosMap[W_BORDER](src - boxRect.tl()));
+			FillPosMapBorder();
+		}
 
-			mPosMap[WO_BORDER] = cv::Mat2i(mColor[WO_BORDER].size());
-			for (int r = 0; r < mPosMap[WO_BORDER].rows; ++r)
+		void OneLvPixMix::SetCandidatePosMap(cv::InputArray posMap, const cv::Rect& roi)
+		{
+			assert(posMap.size() == roi.size() && posMap.type() == CV_16SC2);
+
+			mCandPosMap.create(holeRect.size());
+			mCandPosMap.setTo(cv::Scalar(-1, -1));
+			const cv::Rect src = holeRect & roi;
+			if (!src.empty()) posMap.getMat()(src - roi.tl()).copyTo(mCandPosMap(src - holeRect.tl()));
+			hasCandidates = true;
+		}
+
+		void OneLvPixMix::GetPosMap(const cv::Rect& roi, cv::OutputArray posMap) const
+		{
+			posMap.create(roi.size(), CV_16SC2);
+			cv::Mat2s dst = posMap.getMat();
+			util::ParallelRows(roi.height, roi.width, [&](int rBegin, int rEnd)
+			{
+				for (int r = rBegin; r < rEnd; ++r)
+				{
+					auto ptrDst = dst.ptr<cv::Vec2s>(r);
+					for (int c = 0; c < roi.width; ++c) ptrDst[c] = cv::Vec2s(short(roi.y + r), short(roi.x + c));
+				}
+			});
+			const cv::Rect src = holeRect & roi;
+			if (!src.empty()) mPosMap[WO_BORDER](src - holeRect.tl()).copyTo(dst(src - roi.tl()));
+		}
+
+		void OneLvPixMix::GetCostMap(const cv::Rect& roi, cv::OutputArray costMap) const
+		{
+			costMap.create(roi.size(), CV_16U);
+			cv::Mat1w dst = costMap.getMat();
+			dst.setTo(costInvalid);
+			const cv::Rect src = holeRect & roi;
+			if (!src.empty()) mCostMap(src - holeRect.tl()).copyTo(dst(src - roi.tl()));
+		}
+
+		void OneLvPixMix::ResetPosMap()
+		{
+			for (int br = 0; br < mPosMap[W_BORDER].rows; ++br)
 			{
-				for (int c = 0; c < mPosMap[WO_BORDER].cols; ++c)
+				auto ptrPosMap = mPosMap[W_BORDER].ptr<cv::Vec2s>(br);
+				for (int bc = 0; bc < mPosMap[W_BORDER].cols; ++bc)
 				{
-					if (mMask[WO_BORDER](r, c) == 0) mPosMap[WO_BORDER](r, c) = GetValidRandPos();
-					else mPosMap[WO_BORDER](r, c) = cv::Vec2i(r, c);
+					ptrPosMap[bc] = cv::Vec2s(short(holeRect.y - borderSizePosMap + br), short(holeRect.x - borderSizePosMap + bc));
 				}
 			}
-			cv::copyMakeBorder(mPosMap[WO_BORDER], mPosMap[W_BORDER], borderSizePosMap, borderSizePosMap, borderSizePosMap, borderSizePosMap, cv::BORDER_REFLECT);
-			mPosMap[WO_BORDER] = cv::Mat(mPosMap[W_BORDER], cv::Rect(1, 1, color.cols, color.rows));
-			mCostMap = cv::Mat1f(color.size());
+			FillPosMapBorder();
 		}
 
-		void OneLvPixMix::Run(const PixMixParams& params)
+		void OneLvPixMix::FillPosMapBorder()
 		{
-			const float thDist = std::pow(std::max(mColor[WO_BORDER].cols, mColor[WO_BORDER].rows) * params.threshDist, 2.0f);
+			const int rows = mMask[WO_BORDER].rows, cols = mMask[WO_BORDER].cols;
+			for (int br = 0; br < mPosMap[W_BORDER].rows; ++br)
+			{
+				const int r = holeRect.y - borderSizePosMap + br;
+				for (int bc = 0; bc < mPosMap[W_BORDER].cols; ++bc)
+				{
+					const int c = holeRect.x - borderSizePosMap + bc;
+					if (r >= 0 && r < rows && c >= 0 && c < cols) continue;
+					PosAt(r, c) = PosAt(cv::borderInterpolate(r, rows, cv::BORDER_REFLECT), cv::borderInterpolate(c, cols, cv::BORDER_REFLECT));
+				}
+			}
+		}
 
-			Inpaint();
+		void OneLvPixMix::BuildMaskIndices()
+		{
+			vAnnIdx.clear();
+			hasCandidates = false;
+			vHoleSpans.clear();
+			vHoleRows.clear();
+			numHolePixels = 0;
+			const int rows = mMask[WO_BORDER].rows, cols = mMask[WO_BORDER].cols;
+			vRowSpanIdx.resize(rows + 1);
+			int numValid = 0, cBegin = cols, cEnd = 0;
+			int invalidRBegin = rows, invalidREnd = 0, invalidCBegin = cols, invalidCEnd = 0;
+			for (int r = 0; r < rows; ++r)
+			{
+				vRowSpanIdx[r] = int(vHoleSpans.size());
+				auto ptrMask = mMask[WO_BORDER].ptr<uchar>(r);
+				for (int c = 0; c < cols; ++c)
+				{
+					if (ptrMask[c] == 255)
+					{
+						++numValid;
+						continue;
+					}
+
+					invalidRBegin = std::min(invalidRBegin, r);
+					invalidREnd = r + 1;
+					invalidCBegin = std::min(invalidCBegin, c);
+					invalidCEnd = std::max(invalidCEnd, c + 1);
+					if (ptrMask[c] == 0)
+					{
+						++numHolePixels;
+						if (c == 0 || ptrMask[c - 1] != 0) vHoleSpans.push_back({ r, c, c + 1 });
+						else ++vHoleSpans.back().cEnd;
+					}
+				}
+				if (int(vHoleSpans.size()) > vRowSpanIdx[r])
+				{
+					vHoleRows.push_back(r);
+					cBegin = std::min(cBegin, vHoleSpans[vRowSpanIdx[r]].cBegin);
+					cEnd = std::max(cEnd, vHoleSpans.back().cEnd);
+				}
+			}
+			vRowSpanIdx.back() = int(vHoleSpans.size());
+			assert(numValid > 0);
+
+			// only the valid pixels between the non-valid ones are listed for the random sampling
+			invalidRect = invalidREnd > 0 ? cv::Rect(invalidCBegin, invalidRBegin, invalidCEnd - invalidCBegin, invalidREnd - invalidRBegin) : cv::Rect();
+			vBoxValidIdx.clear();
+			for (int r = invalidRect.y; r < invalidRect.br().y; ++r)
+			{
+				auto ptrMask = mMask[WO_BORDER].ptr<uchar>(r);
+				for (int c = invalidRect.x; c < invalidRect.br().x; ++c)
+				{
+					if (ptrMask[c] == 255) vBoxValidIdx.push_back(r * cols + c);
+				}
+			}
+			numOutsideValid = numValid - int(vBoxValidIdx.size());
+
+			// the solver maps only cover the hole box; every pixel of it matches itself until Init or SetPosMap
+			holeRect = vHoleRows.empty() ? cv::Rect() : cv::Rect(cBegin, vHoleRows.front(), cEnd - cBegin, vHoleRows.back() + 1 - vHoleRows.front());
+			mPosMap[W_BORDER] = cv::Mat2s(holeRect.height + 2 * borderSizePosMap, holeRect.width + 2 * borderSizePosMap);
+			mPosMap[WO_BORDER] = cv::Mat(mPosMap[W_BORDER], cv::Rect(borderSizePosMap, borderSizePosMap, holeRect.width, holeRect.height));
+			ResetPosMap();
+			mCostMap = cv::Mat1w(holeRect.size(), costInvalid);
+			mNnfStamp[W_BORDER] = cv::Mat1w(holeRect.height + 2 * borderSizePosMap, holeRect.width + 2 * borderSizePosMap, ushort(0));
+			mNnfStamp[WO_BORDER] = cv::Mat(mNnfStamp[W_BORDER], cv::Rect(borderSizePosMap, borderSizePosMap, holeRect.width, holeRect.height));
+			changedRect = holeRect.empty() ? cv::Rect() : cv::Rect(holeRect.x - borderSize, holeRect.y - borderSize, holeRect.width + 2 * borderSize, holeRect.height + 2 * borderSize) & cv::Rect(0, 0, cols, rows);
+			mColorChanged = cv::Mat1b(changedRect.size());
+		}
+
+		int OneLvPixMix::Run(const PixMixParams& params)
+		{
+			BeginSolve(params);
+
+			const int numRows = NumHoleRows();
 			for (int itr = 0; itr < params.maxItr; ++itr)
 			{
-				FwdUpdate(params.alpha, 1.0f - params.alpha, thDist, params.maxRandSearchItr);
-				BwdUpdate(params.alpha, 1.0f - params.alpha, thDist, params.maxRandSearchItr);
+				int numChanged = SweepRows(params, true, 0, numRows);
+				numChanged += SweepRows(params, false, 0, numRows);
+				if (Cancelled()) return itr + 1;	// the NNF stays valid; the caller drops the result
+				if (EndIteration(params, itr, numChanged)) return itr + 1;
+			}
+
+			return params.maxItr;
+		}
+
+		void OneLvPixMix::BeginSolve(const PixMixParams& params)
+		{
+			switch (params.windowSize)
+			{
+			case 3: SelectKernels<3>(params); break;
+			case 7: SelectKernels<7>(params); break;
+			default:
+				assert(params.windowSize == 5);
+				SelectKernels<5>(params);
+			}
+
+			(this->*prepareFn)(params);
+		}
+
+		int OneLvPixMix::SweepRows(const PixMixParams& params, bool forward, int begin, int end)
+		{
+			assert(0 <= begin && begin <= end && end <= NumHoleRows());
+			return (this->*sweepFn)(params, forward, begin, end);
+		}
+
+		bool OneLvPixMix::EndIteration(const PixMixParams& params, int itr, int numChanged)
+		{
+			Inpaint();
+
+			// early termination once the NNF has settled
+			if (numChanged < params.minChangeRatio * numHolePixels) return true;
+			if (params.minCostDrop > 0.0f)
+			{
+				const double cost = CalcMeanCost();
+				if (prevCost - cost < params.minCostDrop * prevCost) return true;
+				prevCost = cost;
+			}
+			if (itr + 1 >= params.maxItr) return true;
+
+			InvalidateCosts(params.windowSize / 2);	// around the colors changed by Inpaint
+			return false;
+		}
+
+		template <int W>
+		void OneLvPixMix::SelectKernels(const PixMixParams& params)
+		{
+			switch (params.appMetric)
+			{
+			case APP_METRIC_SAD:
+				prepareFn = &OneLvPixMix::Prepare<W, SadMetric>;
+				sweepFn = &OneLvPixMix::Sweep<W, SadMetric>;
+				break;
+			case APP_METRIC_LUMA:
+				prepareFn = &OneLvPixMix::Prepare<W, LumaMetric>;
+				sweepFn = &OneLvPixMix::Sweep<W, LumaMetric>;
+				break;
+			default:
+				assert(params.appMetric == APP_METRIC_SSD);
+				prepareFn = &OneLvPixMix::Prepare<W, SsdMetric>;
+				sweepFn = &OneLvPixMix::Sweep<W, SsdMetric>;
+			}
+		}
+
+		template <int W, typename Metric>
+		void OneLvPixMix::Prepare(const PixMixParams& params)
+		{
+			static_assert(W % 2 == 1 && W / 2 <= borderSize, "the window must fit in the border");
+
+			thDist = std::pow(std::max(mColor[WO_BORDER].cols, mColor[WO_BORDER].rows) * params.threshDist, 2.0f);
+
+			Inpaint();
+			if (hasCandidates)
+			{
+				SeedFromCandidates<W, Metric>(params, thDist);
+				hasCandidates = false;
+				Inpaint();
+			}
+			if (params.annSeed)
+			{
+				SeedFromAnn<W, Metric>(params, thDist);
 				Inpaint();
 			}
+			mCostMap.setTo(costInvalid);	// colors, mask or weights may differ from the last Run
+			prevCost = DBL_MAX;
+		}
+
+		template <int W, typename Metric>
+		int OneLvPixMix::Sweep(const PixMixParams& params, bool forward, int begin, int end)
+		{
+			return forward ? FwdUpdate<W, Metric>(params, thDist, begin, end) : BwdUpdate<W, Metric>(params, thDist, begin, end);
 		}
 
 		void OneLvPixMix::Inpaint()
 		{
-			for (int r = 0; r < mColor[WO_BORDER].rows; ++r)
+			mColorChanged.setTo(0);
+
+			const auto copyColor = [&](int r)
 			{
 				auto ptrColor = mColor[WO_BORDER].ptr<cv::Vec3b>(r);
-				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2i>(r);
-				for (int c = 0; c < mColor[WO_BORDER].cols; ++c)
+				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(r - holeRect.y);
+				auto ptrColorChanged = mColorChanged.ptr<uchar>(r - changedRect.y);
+				for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+				{
+					for (int c = vHoleSpans[spanIdx].cBegin; c < vHoleSpans[spanIdx].cEnd; ++c)
+					{
+						const cv::Vec2s& ref = ptrPosMap[c - holeRect.x];
+						const cv::Vec3b& color = mColor[WO_BORDER](ref[0], ref[1]);
+						ptrColorChanged[c - changedRect.x] = (ptrColor[c] != color);
+						ptrColor[c] = color;
+					}
+				}
+			};
+
+			// Matches into the hole (left by a warped keyframe) read colors written by this very pass, so the result
+			// depends on the scanline order; such a pass runs serially as a whole and equals the serial pass exactly.
+			std::atomic<bool> holeRef(false);
+			const int numHolePixelsPerRow = vHoleRows.empty() ? 0 : numHolePixels / int(vHoleRows.size());
+			util::ParallelRows(int(vHoleRows.size()), numHolePixelsPerRow, [&](int rowIdxBegin, int rowIdxEnd)
+			{
+				for (int rowIdx = rowIdxBegin; rowIdx < rowIdxEnd && !holeRef.load(std::memory_order_relaxed); ++rowIdx)
 				{
-					ptrColor[c] = mColor[WO_BORDER](ptrPosMap[c]);
+					const int r = vHoleRows[rowIdx];
+					auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(r - holeRect.y);
+					for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+					{
+						for (int c = vHoleSpans[spanIdx].cBegin; c < vHoleSpans[spanIdx].cEnd; ++c)
+						{
+							const cv::Vec2s& ref = ptrPosMap[c - holeRect.x];
+							if (mMask[WO_BORDER](ref[0], ref[1]) == 0) holeRef.store(true, std::memory_order_relaxed);
+						}
+					}
+				}
+			});
+
+			if (holeRef.load())
+			{
+				for (const auto r : vHoleRows) copyColor(r);
+				return;
+			}
+			util::ParallelRows(int(vHoleRows.size()), numHolePixelsPerRow, [&](int rowIdxBegin, int rowIdxEnd)
+			{
+				for (int rowIdx = rowIdxBegin; rowIdx < rowIdxEnd; ++rowIdx) copyColor(vHoleRows[rowIdx]);
+			});
+		}
+
+		void OneLvPixMix::InvalidateCosts(int radius)
+		{
+			if (changedRect.empty()) return;
+
+			// changedRect leaves room for any radius up to borderSize, so this equals a full-frame dilation
+			assert(radius <= borderSize);
+			cv::dilate(mColorChanged, mColorChanged, cv::Mat(), cv::Point(-1, -1), radius);
+			mCostMap.setTo(costInvalid, mColorChanged(cv::Rect(holeRect.tl() - changedRect.tl(), holeRect.size())));
+		}
+
+		double OneLvPixMix::CalcMeanCost()
+		{
+			double sum = 0.0;
+			for (const auto& span : vHoleSpans)
+			{
+				auto ptrCostMap = mCostMap.ptr<ushort>(span.r - holeRect.y);
+				for (int c = span.cBegin; c < span.cEnd; ++c) sum += DecodeCost(ptrCostMap[c - holeRect.x]);
+			}
+
+			return numHolePixels > 0 ? sum / numHolePixels : 0.0;
+		}
+
+		void OneLvPixMix::GetPatch(const cv::Vec2i& p, float* dst)
+		{
+			const int offset = borderSize - annWindowSize / 2;
+			for (int r = 0; r < annWindowSize; ++r)
+			{
+				const uchar* ptrColor = mColor[W_BORDER].ptr<uchar>(r + p[0] + offset) + 3 * (p[1] + offset);
+				for (int c = 0; c < annWindowSize * 3; ++c) *dst++ = float(ptrColor[c]);
+			}
+		}
+
+		template <int W, typename Metric>
+		void OneLvPixMix::SeedFromAnn(const PixMixParams& params, const float thDist)
+		{
+			const float scAlpha = params.alpha;
+			const float acAlpha = 1.0f - params.alpha;
+			const int cols = mColor[WO_BORDER].cols;
+			const int patchLen = annWindowSize * annWindowSize * 3;
+
+			// the patch positions only depend on the mask (BuildMaskIndices drops them); the patches, the PCA and the tree
+			// are built from the current colors in every Run, so that a new frame with the same mask never queries old patches
+			if (vAnnIdx.empty())
+			{
+				// the patches lying entirely in the valid region, on a grid capped at annMaxSamples
+				cv::Mat1b validWindow;
+				cv::erode(mMask[WO_BORDER] == 255, validWindow, cv::Mat(), cv::Point(-1, -1), annWindowSize / 2);
+				const int numValid = cv::countNonZero(validWindow);
+				const int stride = std::max(1, int(std::ceil(std::sqrt(double(numValid) / annMaxSamples))));
+				for (int r = 0; r < validWindow.rows; r += stride)
+				{
+					auto ptrValid = validWindow.ptr<uchar>(r);
+					for (int c = 0; c < validWindow.cols; c += stride)
+					{
+						if (ptrValid[c] != 0) vAnnIdx.push_back(r * cols + c);
+					}
+				}
+			}
+			if (int(vAnnIdx.size()) <= params.annDims) return;
+
+			annData.create(int(vAnnIdx.size()), patchLen);
+			for (int i = 0; i < int(vAnnIdx.size()); ++i)
+			{
+				GetPatch(cv::Vec2i(vAnnIdx[i] / cols, vAnnIdx[i] % cols), annData.ptr<float>(i));
+			}
+			annPca(annData, cv::noArray(), cv::PCA::DATA_AS_ROW, params.annDims);
+			annPca.project(annData, annFeatures);
+			// a single kd-tree is built without FLANN's global RNG, so the seed only depends on params.seed and the input
+			cv::flann::Index annIndex(annFeatures, cv::flann::KDTreeSingleIndexParams());
+
+			// query the current patch of every hole pixel and keep the candidate if it is cheaper
+			cv::Mat1f query, queryFeatures, dists;
+			cv::Mat1i indices;
+			for (const auto r : vHoleRows)
+			{
+				int numQueries = 0;
+				for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+				{
+					numQueries += vHoleSpans[spanIdx].cEnd - vHoleSpans[spanIdx].cBegin;
+				}
+				query.create(numQueries, patchLen);
+				int q = 0;
+				for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+				{
+					for (int c = vHoleSpans[spanIdx].cBegin; c < vHoleSpans[spanIdx].cEnd; ++c) GetPatch(cv::Vec2i(r, c), query.ptr<float>(q++));
+				}
+				annPca.project(query, queryFeatures);
+				annIndex.knnSearch(queryFeatures, indices, dists, 1, cv::flann::SearchParams(32));
+
+				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(r - holeRect.y);
+				q = 0;
+				for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+				{
+					for (int c = vHoleSpans[spanIdx].cBegin; c < vHoleSpans[spanIdx].cEnd; ++c, ++q)
+					{
+						if (indices(q, 0) < 0) continue;
+						const cv::Vec2i target(r, c);
+						const cv::Vec2i cand(vAnnIdx[indices(q, 0)] / cols, vAnnIdx[indices(q, 0)] % cols);
+						const float cost = CalcCost<W, Metric>(target, cv::Vec2i(ptrPosMap[c - holeRect.x]), scAlpha, acAlpha, thDist);
+						const float costCand = CalcCost<W, Metric>(target, cand, scAlpha, acAlpha, thDist, cost);
+						if (costCand < cost) ptrPosMap[c - holeRect.x] = cv::Vec2s(cand);
+					}
+				}
+			}
+		}
+
+		template <int W, typename Metric>
+		void OneLvPixMix::SeedFromCandidates(const PixMixParams& params, const float thDist)
+		{
+			const float scAlpha = params.alpha;
+			const float acAlpha = 1.0f - params.alpha;
+			const int rows = mMask[WO_BORDER].rows, cols = mMask[WO_BORDER].cols;
+
+			// in scanline order (as SeedFromAnn), so that the spatial costs see the candidates taken before
+			for (const auto& span : vHoleSpans)
+			{
+				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(span.r - holeRect.y);
+				auto ptrCandPosMap = mCandPosMap.ptr<cv::Vec2s>(span.r - holeRect.y);
+				for (int c = span.cBegin; c < span.cEnd; ++c)
+				{
+					const int s = c - holeRect.x;
+					const cv::Vec2i cand(ptrCandPosMap[s]);
+					const cv::Vec2i ref(ptrPosMap[s]);
+					if (cand[0] < 0 || cand[0] >= rows || cand[1] < 0 || cand[1] >= cols || cand == ref || mMask[WO_BORDER](cand[0], cand[1]) != 255) continue;
+
+					const cv::Vec2i target(span.r, c);
+					const float cost = CalcCost<W, Metric>(target, ref, scAlpha, acAlpha, thDist);
+					const float costCand = CalcCost<W, Metric>(target, cand, scAlpha, acAlpha, thDist, cost);
+					if (costCand < cost) ptrPosMap[s] = cv::Vec2s(cand);
 				}
 			}
 		}
@@ -71,198 +623,326 @@ namespace dr
 		float OneLvPixMix::CalcSptCost(
 			const cv::Vec2i& target,
 			const cv::Vec2i& ref,
-			float maxDist,
-			float w
+			float maxDist
 		)
 		{
+			const float w = 1.0f / 8.0f;
 			const float normFactor = maxDist * 2.0f;
 
 			float sc = 0.0f;
-			for (const auto& v : vSptAdj)
+			for (int i = 0; i < 8; ++i)
 			{
-				cv::Vec2f diff((ref + v) - mPosMap[W_BORDER](target + cv::Vec2i(borderSizePosMap, borderSizePosMap) + v));
-				sc += std::min(diff.dot(diff), maxDist);
+				const cv::Vec2s& refAdj = PosAt(target[0] + sptAdj[i][0], target[1] + sptAdj[i][1]);
+				const float dRow = float(ref[0] + sptAdj[i][0] - refAdj[0]);
+				const float dCol = float(ref[1] + sptAdj[i][1] - refAdj[1]);
+				sc += std::min(dRow * dRow + dCol * dCol, maxDist);
 			}
 
 			return sc * w / normFactor;
 		}
 
+		template <int W, typename Metric>
 		float OneLvPixMix::CalcAppCost(
 			const cv::Vec2i& target,
 			const cv::Vec2i& ref,
-			float w
+			float maxCost
 		)
 		{
-			const float normFctor = 255.0f * 255.0f * 3.0f;
+			const float w = 1.0f / float(W * W);
+			const float scale = w / Metric::normFactor;
+			const int offset = borderSize - W / 2;
 
-			float ac = 0.0f;
-			for (int r = 0; r < windowSize; ++r)
+			// a masked pixel in the reference window outweighs any color difference
+			int numMasked = 0;
+			for (int r = 0; r < W; ++r)
 			{
-				uchar* ptrMask = mMask[W_BORDER].ptr<uchar>(r + ref[0]);
-				cv::Vec3b* ptrTargetColor = mColor[W_BORDER].ptr<cv::Vec3b>(r + target[0]);
-				cv::Vec3b* ptrRefColor = mColor[W_BORDER].ptr<cv::Vec3b>(r + ref[0]);
-				for (int c = 0; c < windowSize; ++c)
-				{
-					if (ptrMask[c + ref[1]] == 0)
-					{
-						ac += FLT_MAX / 25.0f;
-					}
-					else
-					{
-						cv::Vec3f diff(cv::Vec3f(ptrTargetColor[c + target[1]]) - cv::Vec3f(ptrRefColor[c + ref[1]]));
-						ac += diff.dot(diff);
-					}
-				}
+				const uchar* ptrMask = mMask[W_BORDER].ptr<uchar>(r + ref[0] + offset) + ref[1] + offset;
+				for (int c = 0; c < W; ++c) numMasked += (ptrMask[c] == 0);
 			}
+			if (numMasked > 0) return float(numMasked) * (FLT_MAX / float(W * W)) * scale;
+
+			const uchar* ptrTargetColor = mColor[W_BORDER].ptr<uchar>(target[0] + offset) + 3 * (target[1] + offset);
+			const uchar* ptrRefColor = mColor[W_BORDER].ptr<uchar>(ref[0] + offset) + 3 * (ref[1] + offset);
+			const double bound = double(maxCost) / scale;
 
-			return ac * w / normFctor;
+			return float(Metric::template Calc<W>(ptrTargetColor, ptrRefColor, mColor[W_BORDER].step, bound < double(INT_MAX) ? int(bound) : INT_MAX)) * scale;
 		}
 
+		template <int W, typename Metric>
+		float OneLvPixMix::CalcCost(
+			const cv::Vec2i& target,
+			const cv::Vec2i& ref,
+			const float scAlpha,
+			const float acAlpha,
+			const float thDist,
+			float maxCost
+		)
+		{
+			const float sc = scAlpha * CalcSptCost(target, ref, thDist);
+			if (sc > maxCost || acAlpha <= 0.0f) return sc;
+
+			return sc + acAlpha * CalcAppCost<W, Metric>(target, ref, (maxCost - sc) / acAlpha);
+		}
 
-		void OneLvPixMix::FwdUpdate(
+		template <int W, typename Metric>
+		void OneLvPixMix::RandomSearch(
+			const cv::Vec2i& target,
+			cv::Vec2i& ref,
+			float& cost,
+			const uint32_t sweep,
 			const float scAlpha,
 			const float acAlpha,
 			const float thDist,
-			const int maxRandSearchItr
+			const PixMixParams& params
 		)
 		{
-#pragma omp parallel for // NOTE: This is not thread-safe
-			for (int r = 0; r < mColor[WO_BORDER].rows; ++r)
+			if (params.randSearchMode == RAND_SEARCH_LOCAL)
 			{
-				auto ptrMask = mMask[WO_BORDER].ptr<uchar>(r);
-				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2i>(r);
-				auto ptrCostMap = mCostMap.ptr<float>(r);
-				for (int c = 0; c < mColor[WO_BORDER].cols; ++c)
+				// PatchMatch: one sample per window whose radius shrinks exponentially around the best match so far
+				assert(params.randSearchDecay > 0.0f && params.randSearchDecay < 1.0f);
+				const int rows = mColor[WO_BORDER].rows;
+				const int cols = mColor[WO_BORDER].cols;
+				uint32_t draw = 0;
+				for (float radius = float(std::max(rows, cols)); radius >= 1.0f; radius *= params.randSearchDecay, ++draw)
 				{
-					if (ptrMask[c] == 0)
+					const int rad = int(radius);
+					cv::Vec2i refRand(
+						ref[0] + Philox4x32::ToRange(rng(target[0], target[1], sweep, 2 * draw), 2 * rad + 1) - rad,
+						ref[1] + Philox4x32::ToRange(rng(target[0], target[1], sweep, 2 * draw + 1), 2 * rad + 1) - rad
+					);
+					refRand[0] = std::min(std::max(refRand[0], 0), rows - 1);
+					refRand[1] = std::min(std::max(refRand[1], 0), cols - 1);
+					if (mMask[WO_BORDER](refRand) != 255) continue;
+
+					const float costRand = CalcCost<W, Metric>(target, refRand, scAlpha, acAlpha, thDist, cost);
+					if (costRand < cost)
+					{
+						ref = refRand;
+						cost = costRand;
+					}
+				}
+			}
+			else
+			{
+				int itrNum = 0;
+				cv::Vec2i refRand;
+				float costRand = FLT_MAX;
+				do {
+					refRand = GetValidRandPos(rng(target[0], target[1], sweep, itrNum));
+					costRand = CalcCost<W, Metric>(target, refRand, scAlpha, acAlpha, thDist, cost);
+				} while (costRand >= cost && ++itrNum < params.maxRandSearchItr);
+
+				if (costRand < cost)
+				{
+					ref = refRand;
+					cost = costRand;
+				}
+			}
+		}
+
+		template <int W, typename Metric>
+		int OneLvPixMix::FwdUpdate(const PixMixParams& params, const float thDist, int begin, int end)
+		{
+			const float scAlpha = params.alpha;
+			const float acAlpha = 1.0f - params.alpha;
+
+			// Wavefront schedule: a row may visit column c once the row above has finished c + 1,
+			// so every read of mPosMap sees exactly what the sequential raster scan would see
+			const int rows = mColor[WO_BORDER].rows;
+			const int cols = mColor[WO_BORDER].cols;
+			if (begin == 0)
+			{
+				for (int r = 0; r < rows; ++r)
+				{
+					rowProgress[r].store(vRowSpanIdx[r] == vRowSpanIdx[r + 1] ? cols : 0, std::memory_order_relaxed);
+				}
+				++sweepCount;
+			}
+			const uint32_t sweep = sweepCount;
+			int numChanged = 0;
+
+#pragma omp parallel for schedule(static, 1) reduction(+:numChanged)	// rows must be taken in order for the wavefront
+			for (int rowIdx = begin; rowIdx < end; ++rowIdx)
+			{
+				const int r = vHoleRows[rowIdx];
+				// a cancelled row publishes full progress so that the row waiting on it moves on
+				if (Cancelled())
+				{
+					rowProgress[r].store(cols, std::memory_order_release);
+					continue;
+				}
+				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(r - holeRect.y);	// the hole box rows are indexed by c - holeRect.x
+				auto ptrCostMap = mCostMap.ptr<ushort>(r - holeRect.y);
+				auto ptrStamp = mNnfStamp[WO_BORDER].ptr<ushort>(r - holeRect.y);
+				auto ptrStampUp = mNnfStamp[W_BORDER].ptr<ushort>(r - holeRect.y) + borderSizePosMap;
+				for (int spanIdx = vRowSpanIdx[r]; spanIdx < vRowSpanIdx[r + 1]; ++spanIdx)
+				{
+					const auto& span = vHoleSpans[spanIdx];
+					rowProgress[r].store(span.cBegin, std::memory_order_release);
+					for (int c = span.cBegin; c < span.cEnd; ++c)
 					{
+						if (r > 0) WaitForRow(r - 1, std::min(c + 2, cols));
+
+						const int s = c - holeRect.x;
 						cv::Vec2i target(r, c);
-						cv::Vec2i ref = ptrPosMap[target[1]];
+						const cv::Vec2i ref(ptrPosMap[s]);
+						cv::Vec2i best = ref;
 						cv::Vec2i top = target + toUp;
 						cv::Vec2i left = target + toLeft;
 						if (top[0] < 0) top[0] = 0;
 						if (left[1] < 0) left[1] = 0;
-						cv::Vec2i topRef = mPosMap[WO_BORDER](top) + toDown;
-						cv::Vec2i leftRef = mPosMap[WO_BORDER](left) + toRight;
-						if (topRef[0] >= mColor[WO_BORDER].rows) topRef[0] = mPosMap[WO_BORDER](top)[0];
-						if (leftRef[1] >= mColor[WO_BORDER].cols) leftRef[1] = mPosMap[WO_BORDER](left)[1];
+						cv::Vec2i topRef = cv::Vec2i(PosAt(top[0], top[1])) + toDown;
+						cv::Vec2i leftRef = cv::Vec2i(PosAt(left[0], left[1])) + toRight;
+						if (topRef[0] >= mColor[WO_BORDER].rows) topRef[0] = PosAt(top[0], top[1])[0];
+						if (leftRef[1] >= mColor[WO_BORDER].cols) leftRef[1] = PosAt(left[0], left[1])[1];
 
 						// propagate
-						float cost = scAlpha * CalcSptCost(target, ref, thDist) + acAlpha * CalcAppCost(target, ref);
+						// the cost from the last sweep still holds unless the colors around the target
+						// or the match of a neighbour visited after it (i.e. before it in this sweep) changed
+						const bool costValid = ptrCostMap[s] != costInvalid
+							&& !ChangedRecently(ptrStampUp[s - 1], sweep) && !ChangedRecently(ptrStampUp[s], sweep) && !ChangedRecently(ptrStampUp[s + 1], sweep)
+							&& !ChangedRecently(ptrStamp[s - 1], sweep);
+						float cost = costValid ? DecodeCost(ptrCostMap[s]) : CalcCost<W, Metric>(target, ref, scAlpha, acAlpha, thDist);
 						float costTop = FLT_MAX, costLeft = FLT_MAX;
 
 						if (mMask[WO_BORDER](top) == 0 && mMask[WO_BORDER](topRef) != 0)
 						{
-							costTop = scAlpha * CalcSptCost(target, topRef, thDist) + acAlpha * CalcAppCost(target, topRef);
+							costTop = CalcCost<W, Metric>(target, topRef, scAlpha, acAlpha, thDist, cost);
 						}
 						if (mMask[WO_BORDER](left) == 0 && mMask[WO_BORDER](leftRef) != 0)
 						{
-							costLeft = scAlpha * CalcSptCost(target, leftRef, thDist) + acAlpha * CalcAppCost(target, leftRef);
+							costLeft = CalcCost<W, Metric>(target, leftRef, scAlpha, acAlpha, thDist, std::min(cost, costTop));
 						}
 
 						if (costTop < cost && costTop < costLeft)
 						{
 							cost = costTop;
-							ptrPosMap[target[1]] = topRef;
+							best = topRef;
 						}
 						else if (costLeft < cost)
 						{
 							cost = costLeft;
-							ptrPosMap[target[1]] = leftRef;
+							best = leftRef;
 						}
 
 						// random search
-						int itrNum = 0;
-						cv::Vec2i refRand;
-						float costRand = FLT_MAX;
-						do {
-							refRand = GetValidRandPos();
-							costRand = scAlpha * CalcSptCost(target, refRand, thDist) + acAlpha * CalcAppCost(target, refRand);
-						} while (costRand >= cost && ++itrNum < maxRandSearchItr);
-
-						if (costRand < cost)
+						RandomSearch<W, Metric>(target, best, cost, sweep, scAlpha, acAlpha, thDist, params);
+
+						ptrCostMap[s] = EncodeCost(cost);
+						if (best != ref)
 						{
-							ptrPosMap[target[1]] = refRand;
-							cost = costRand;
+							ptrPosMap[s] = cv::Vec2s(best);
+							ptrStamp[s] = ushort(sweep);
+							++numChanged;
 						}
-
-						ptrCostMap[c] = cost;
+						rowProgress[r].store(c + 1, std::memory_order_release);
 					}
 				}
+				rowProgress[r].store(cols, std::memory_order_release);
 			}
+
+			return numChanged;
 		}
 
-		void OneLvPixMix::BwdUpdate(
-			const float scAlpha,
-			const float acAlpha,
-			const float thDist,
-			const int maxRandSearchItr
-		)
+		template <int W, typename Metric>
+		int OneLvPixMix::BwdUpdate(const PixMixParams& params, const float thDist, int begin, int end)
 		{
-#pragma omp parallel for // NOTE: This is not thread-safe
-			for (int r = mColor[WO_BORDER].rows - 1; r >= 0; --r)
+			const float scAlpha = params.alpha;
+			const float acAlpha = 1.0f - params.alpha;
+
+			// mirrored wavefront: progress counts the columns finished from the right
+			const int rows = mColor[WO_BORDER].rows;
+			const int cols = mColor[WO_BORDER].cols;
+			if (begin == 0)
 			{
-				auto ptrMask = mMask[WO_BORDER].ptr<uchar>(r);
-				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2i>(r);
-				auto ptrCostMap = mCostMap.ptr<float>(r);
-				for (int c = mColor[WO_BORDER].cols - 1; c >= 0; --c)
+				for (int r = 0; r < rows; ++r)
 				{
-					if (ptrMask[c] == 0)
+					rowProgress[r].store(vRowSpanIdx[r] == vRowSpanIdx[r + 1] ? cols : 0, std::memory_order_relaxed);
+				}
+				++sweepCount;
+			}
+			const uint32_t sweep = sweepCount;
+			int numChanged = 0;
+
+#pragma omp parallel for schedule(static, 1) reduction(+:numChanged)	// rows must be taken in order for the wavefront
+			for (int rowIdx = begin; rowIdx < end; ++rowIdx)
+			{
+				const int r = vHoleRows[int(vHoleRows.size()) - 1 - rowIdx];	// bottom-up
+				// a cancelled row publishes full progress so that the row waiting on it moves on
+				if (Cancelled())
+				{
+					rowProgress[r].store(cols, std::memory_order_release);
+					continue;
+				}
+				auto ptrPosMap = mPosMap[WO_BORDER].ptr<cv::Vec2s>(r - holeRect.y);	// the hole box rows are indexed by c - holeRect.x
+				auto ptrCostMap = mCostMap.ptr<ushort>(r - holeRect.y);
+				auto ptrStamp = mNnfStamp[WO_BORDER].ptr<ushort>(r - holeRect.y);
+				auto ptrStampDown = mNnfStamp[W_BORDER].ptr<ushort>(r - holeRect.y + 2) + borderSizePosMap;
+				for (int spanIdx = vRowSpanIdx[r + 1] - 1; spanIdx >= vRowSpanIdx[r]; --spanIdx)
+				{
+					const auto& span = vHoleSpans[spanIdx];
+					rowProgress[r].store(cols - span.cEnd, std::memory_order_release);
+					for (int c = span.cEnd - 1; c >= span.cBegin; --c)
 					{
+						if (r < rows - 1) WaitForRow(r + 1, std::min(cols - c + 1, cols));
+
+						const int s = c - holeRect.x;
 						cv::Vec2i target(r, c);
-						cv::Vec2i ref = ptrPosMap[target[1]];
+						const cv::Vec2i ref(ptrPosMap[s]);
+						cv::Vec2i best = ref;
 						cv::Vec2i bottom = target + toDown;
 						cv::Vec2i right = target + toRight;
 						if (bottom[0] >= mColor[WO_BORDER].rows) bottom[0] = target[0];
 						if (right[1] >= mColor[WO_BORDER].cols) right[1] = target[1];
-						cv::Vec2i bottomRef = mPosMap[WO_BORDER](bottom) + toUp;
-						cv::Vec2i rightRef = mPosMap[WO_BORDER](right) + toLeft;
+						cv::Vec2i bottomRef = cv::Vec2i(PosAt(bottom[0], bottom[1])) + toUp;
+						cv::Vec2i rightRef = cv::Vec2i(PosAt(right[0], right[1])) + toLeft;
 						if (bottomRef[0] < 0) bottomRef[0] = 0;
 						if (rightRef[1] < 0) rightRef[1] = 0;
 
-						// propagate
-						float cost = scAlpha * CalcSptCost(target, ref, thDist) + acAlpha * CalcAppCost(target, ref);
+						// propagate (see FwdUpdate for the reuse of the cost)
+						const bool costValid = ptrCostMap[s] != costInvalid
+							&& !ChangedRecently(ptrStampDown[s - 1], sweep) && !ChangedRecently(ptrStampDown[s], sweep) && !ChangedRecently(ptrStampDown[s + 1], sweep)
+							&& !ChangedRecently(ptrStamp[s + 1], sweep);
+						float cost = costValid ? DecodeCost(ptrCostMap[s]) : CalcCost<W, Metric>(target, ref, scAlpha, acAlpha, thDist);
 						float costTop = FLT_MAX, costLeft = FLT_MAX;
 
 						if (mMask[WO_BORDER](bottom) == 0 && mMask[WO_BORDER](bottomRef) != 0)
 						{
-							costTop = scAlpha * CalcSptCost(target, bottomRef, thDist) + acAlpha * CalcAppCost(target, bottomRef);
+							costTop = CalcCost<W, Metric>(target, bottomRef, scAlpha, acAlpha, thDist, cost);
 						}
 						if (mMask[WO_BORDER](right) == 0 && mMask[WO_BORDER](rightRef) != 0)
 						{
-							costLeft = scAlpha * CalcSptCost(target, rightRef, thDist) + acAlpha * CalcAppCost(target, rightRef);
+							costLeft = CalcCost<W, Metric>(target, rightRef, scAlpha, acAlpha, thDist, std::min(cost, costTop));
 						}
 
 						if (costTop < cost && costTop < costLeft)
 						{
 							cost = costTop;
-							ptrPosMap[target[1]] = bottomRef;
+							best = bottomRef;
 						}
 						else if (costLeft < cost)
 						{
 							cost = costLeft;
-							ptrPosMap[target[1]] = rightRef;
+							best = rightRef;
 						}
 
 						// random search
-						int itrNum = 0;
-						cv::Vec2i refRand;
-						float costRand = FLT_MAX;
-						do {
-							refRand = GetValidRandPos();
-							costRand = scAlpha * CalcSptCost(target, refRand, thDist) + acAlpha * CalcAppCost(target, refRand);
-						} while (costRand >= cost && ++itrNum < maxRandSearchItr);
-
-						if (costRand < cost)
+						RandomSearch<W, Metric>(target, best, cost, sweep, scAlpha, acAlpha, thDist, params);
+
+						ptrCostMap[s] = EncodeCost(cost);
+						if (best != ref)
 						{
-							ptrPosMap[target[1]] = refRand;
-							cost = costRand;
+							ptrPosMap[s] = cv::Vec2s(best);
+							ptrStamp[s] = ushort(sweep);
+							++numChanged;
 						}
-
-						ptrCostMap[c] = cost;
+						rowProgress[r].store(cols - c, std::memory_order_release);
 					}
 				}
+				rowProgress[r].store(cols, std::memory_order_release);
 			}
+
+			return numChanged;
 		}
 	}
 }
\ No newline at end of file
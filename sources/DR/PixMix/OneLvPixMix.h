@@ -1,87 +1,224 @@
 #pragma once
 
-#include <random>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
+#include "Philox.h"
 #include "Utilities.h"
 
 namespace dr
 {
 	namespace det
 	{
+		enum RandSearchMode
+		{
+			RAND_SEARCH_GLOBAL = 0,	// uniform samples over the whole level
+			RAND_SEARCH_LOCAL = 1	// PatchMatch samples in exponentially shrinking windows around the current match
+		};
+
+		enum AppMetric
+		{
+			APP_METRIC_SSD = 0,		// sum of squared BGR differences
+			APP_METRIC_SAD = 1,		// sum of absolute BGR differences
+			APP_METRIC_LUMA = 2		// sum of squared luma differences
+		};
+
 		struct PixMixParams
 		{
 			int maxItr = 1;				// max iteration per pyramid level
-			int maxRandSearchItr = 0;	// max number of random sampling per pixel
+			int maxRandSearchItr = 0;	// max number of random sampling per pixel (RAND_SEARCH_GLOBAL)
+			int randSearchMode = RAND_SEARCH_GLOBAL;
+			float randSearchDecay = 0.5f;	// window radius ratio between two samples (RAND_SEARCH_LOCAL)
 			float alpha = 0.05f;		// balancing parameter between spatial and appearance cost
+			int windowSize = 5;			// window size of the appearance cost (3, 5 or 7)
+			int appMetric = APP_METRIC_SSD;
 			float threshDist = 0.5f;	// 0.5 means the half of the width/height is the maximum
 			int blurSize = 5;			// blur kernel size for the final composition
 			int maxPyrmLv = 5;			// maximum pyramid level
+			unsigned int seed = 0;		// random seed; the same seed reproduces the same result on any number of threads
+			float minChangeRatio = 0.0f;	// a level converges when fewer hole pixels than this ratio change their match in an iteration (0: off)
+			float minCostDrop = 0.0f;	// a level converges when the mean cost drops by less than this ratio in an iteration (0: off)
+			bool annSeed = false;		// seed the NNF from a kd-tree of PCA-reduced patches before the sweeps (the tree is built from the colors of every Run)
+			int annDims = 8;			// PCA dimensions of the patch descriptors (annSeed)
 		};
 
+		// Compact per-pixel storage: the NNF holds absolute (row, col) positions as int16
+		// and the cost map holds costs in [0, 1] as 16-bit fixed point (cv::Mat2s, cv::Mat1w).
+		const ushort costInvalid = 65535;	// not evaluated since the last change around the pixel
+		const float costScale = 65534.0f;
+
+		inline ushort EncodeCost(float cost)
+		{
+			return ushort(std::min(cost, 1.0f) * costScale + 0.5f);
+		}
+		inline float DecodeCost(ushort cost)
+		{
+			return float(cost) / costScale;
+		}
+
+		// conversions to the plain representations (cv::Mat2i positions, cv::Mat1f costs) for debugging
+		void DecodePosMap(cv::InputArray srcPosMap, cv::OutputArray dstPosMap);
+		void DecodeCostMap(cv::InputArray srcCostMap, cv::OutputArray dstCostMap);
+
 		class OneLvPixMix
 		{
 		public:
 			OneLvPixMix();
+			OneLvPixMix(OneLvPixMix&&) = default;
 			~OneLvPixMix();
 
-			void Init(const cv::Mat3b& color, const cv::Mat1b& mask);
-			void Run(const PixMixParams& params);
+			// (re)allocates the level buffers only when the size changes
+			void Allocate(const cv::Size& size);
+			void Init(const cv::Mat3b& color, const cv::Mat1b& mask, unsigned int seed = 0, int lv = 0);
+			// initializes from the color and mask already written into the level buffers
+			void Init(unsigned int seed = 0, int lv = 0);
+			void SetMask(const cv::Mat1b& mask);
+			// posMap holds the matches of the pixels in roi, which must cover HoleRect(); every other pixel matches itself
+			void SetPosMap(cv::InputArray posMap, const cv::Rect& roi);
+			// Second matches of the pixels in roi (e.g. from another keyframe; off-level entries: none), for the next Run only.
+			// Before the sweeps, each hole pixel takes its candidate where it is cheaper than the current match.
+			void SetCandidatePosMap(cv::InputArray posMap, const cv::Rect& roi);
+			int Run(const PixMixParams& params);	// returns the number of iterations actually used
+
+			// Run in resumable pieces (PixMix::Step): BeginSolve, then per iteration the hole rows [begin, end) of the
+			// forward and the backward sweep in as many calls as wanted (in sweep order), then EndIteration
+			void BeginSolve(const PixMixParams& params);
+			int SweepRows(const PixMixParams& params, bool forward, int begin, int end);	// returns the number of changed matches
+			bool EndIteration(const PixMixParams& params, int itr, int numChanged);	// true once the level is done
+			inline int NumHoleRows() const { return int(vHoleRows.size()); }
+			inline const cv::Rect& HoleRect() const { return holeRect; }	// bounding box of the mask == 0 pixels
+			inline const cv::Rect& InvalidRect() const { return invalidRect; }	// bounding box of the mask != 255 pixels
+			// Run stops within one row of every thread once *cancel turns true (nullptr: never)
+			inline void SetCancelFlag(const std::atomic<bool>* cancel) { this->cancel = cancel; }
 
 			cv::Mat3b* GetColorPtr();
 			cv::Mat1b* GetMaskPtr();
-			cv::Mat2i* GetPosMapPtr();
-			cv::Mat1f* GetCostMapPtr();
+			// The NNF and the costs are only kept inside HoleRect(); outside of it every pixel matches itself
+			// and has the cost costInvalid. GetPosMap and GetCostMap compose the maps of any roi of the level.
+			cv::Mat2s* GetPosMapPtr();	// of HoleRect()
+			cv::Mat1w* GetCostMapPtr();	// of HoleRect()
+			cv::Vec2s GetPos(int r, int c) const;
+			void GetPosMap(const cv::Rect& roi, cv::OutputArray posMap) const;
+			void GetCostMap(const cv::Rect& roi, cv::OutputArray costMap) const;
 
 		private:
-			const int borderSize;
-			const int borderSizePosMap;
-			const int windowSize;
+			static constexpr int borderSize = 3;		// half of the largest window
+			static constexpr int borderSizePosMap = 1;
+			static constexpr int simdPadding = 4;		// extra columns on the right of mColor[W_BORDER] for 16-byte loads
+			static constexpr int annWindowSize = 5;		// window size of the ANN patch descriptors
 
 			enum { WO_BORDER = 0, W_BORDER = 1 };
 			cv::Mat3b mColor[2];
 			cv::Mat1b mMask[2];
-			cv::Mat2i mPosMap[2];	// current position map: f
-			cv::Mat1f mCostMap;
+			// Only hole pixels are matched and costed, so the per-pixel solver maps cover the hole box
+			// (plus what their readers need around it) and the frame-sized buffers are the color and the mask only.
+			cv::Mat2s mPosMap[2];	// current position map: f, of holeRect (with a border of borderSizePosMap)
+			cv::Mat1w mCostMap;		// of holeRect; costInvalid once the colors around the pixel changed
+
+			// cost bookkeeping: the cost of the current match is reused while nothing it depends on has changed
+			cv::Mat1w mNnfStamp[2];		// sweep (modulo 2^16) in which the match of each pixel of holeRect last changed
+			cv::Mat1b mColorChanged;	// pixels of changedRect whose color changed in the last Inpaint
+			cv::Rect changedRect;		// holeRect grown by borderSize (the largest invalidation radius)
 
 			const cv::Vec2i toLeft;
 			const cv::Vec2i toRight;
 			const cv::Vec2i toUp;
 			const cv::Vec2i toDown;
-			std::vector<cv::Vec2i> vSptAdj;
 
-			std::mt19937 mt;
-			std::uniform_int_distribution<int> cRand;
-			std::uniform_int_distribution<int> rRand;
+			Philox4x32 rng;			// keyed by (seed, level) and counted by (row, col, sweep, draw)
+			uint32_t sweepCount;
+			// random sampling source: the pixels with mask == 255, those outside invalidRect first (in scanline order,
+			// found arithmetically) and then the listed ones inside it, so that the index only grows with the box
+			cv::Rect invalidRect;			// bounding box of the mask != 255 pixels
+			int numOutsideValid;
+			std::vector<int> vBoxValidIdx;	// linear indices of the valid pixels inside invalidRect
+
+			struct HoleSpan { int r, cBegin, cEnd; };	// run of mask == 0 pixels in [cBegin, cEnd) on row r
+			std::vector<HoleSpan> vHoleSpans;			// in scanline order
+			std::vector<int> vHoleRows;					// rows having at least one span
+			std::vector<int> vRowSpanIdx;				// spans of row r are [vRowSpanIdx[r], vRowSpanIdx[r + 1])
+			int numHolePixels;
+			cv::Rect holeRect;
+
+			// approximate nearest-neighbour index over the valid patches (PixMixParams::annSeed)
+			const int annMaxSamples;
+			std::vector<int> vAnnIdx;	// linear index of the center of each indexed patch (kept while the mask stays the same)
+			cv::Mat1f annData, annFeatures;
+			cv::PCA annPca;
+
+			cv::Mat2s mCandPosMap;	// of holeRect (SetCandidatePosMap)
+			bool hasCandidates;
+
+			// number of columns each row has finished in the current sweep (wavefront scheduling)
+			std::unique_ptr<std::atomic<int>[]> rowProgress;
+			const std::atomic<bool>* cancel;
+
+			inline bool Cancelled() const { return cancel != nullptr && cancel->load(std::memory_order_relaxed); }
 
-			cv::Vec2i GetValidRandPos();
+			void BuildMaskIndices();
+			cv::Vec2s& PosAt(int r, int c);	// entry of mPosMap[W_BORDER] of a level pixel, holeRect grown by borderSizePosMap
+			void ResetPosMap();				// every pixel of the hole box matches itself
+			void FillPosMapBorder();		// the entries outside the level reflect it (cv::BORDER_REFLECT)
+			cv::Vec2i GetValidRandPos(uint32_t rnd);
+			void WaitForRow(int r, int numCols);
+			bool ChangedRecently(ushort stamp, uint32_t sweep);	// in the previous or the current sweep
 
 			void Inpaint();
+			void InvalidateCosts(int radius);	// for the pixels closer than radius to a color change
+			double CalcMeanCost();
+			void GetPatch(const cv::Vec2i& p, float* dst);
+
+			// the solver is instantiated per window size W and appearance metric policy; BeginSolve picks the kernels
+			using PrepareFn = void (OneLvPixMix::*)(const PixMixParams&);
+			using SweepFn = int (OneLvPixMix::*)(const PixMixParams&, bool, int, int);
+			PrepareFn prepareFn;
+			SweepFn sweepFn;
+			float thDist;		// of the current solve
+			double prevCost;	// mean cost after the last iteration (PixMixParams::minCostDrop)
+
+			template <int W> void SelectKernels(const PixMixParams& params);
+			template <int W, typename Metric> void Prepare(const PixMixParams& params);
+			template <int W, typename Metric> int Sweep(const PixMixParams& params, bool forward, int begin, int end);
+			template <int W, typename Metric> void SeedFromAnn(const PixMixParams& params, const float thDist);
+			template <int W, typename Metric> void SeedFromCandidates(const PixMixParams& params, const float thDist);
 
 			float CalcSptCost(
 				const cv::Vec2i& target,
 				const cv::Vec2i& ref,
-				float maxDist,		// tau_s
-				float w = 0.125f	// 1.0f / 8.0f
+				float maxDist		// tau_s
 			);
-			float CalcAppCost(
+			template <int W, typename Metric> float CalcAppCost(
 				const cv::Vec2i& target,
 				const cv::Vec2i& ref,
-				float w = 0.04f		// 1.0f / 25.0f
+				float maxCost = FLT_MAX	// stops accumulating once the cost exceeds it
 			);
-
-			void FwdUpdate(
+			// scAlpha * spatial + acAlpha * appearance; any value returned above maxCost is a lower bound only
+			template <int W, typename Metric> float CalcCost(
+				const cv::Vec2i& target,
+				const cv::Vec2i& ref,
 				const float scAlpha,
 				const float acAlpha,
 				const float thDist,
-				const int maxRandSearchItr
+				float maxCost = FLT_MAX
 			);
-			void BwdUpdate(
+
+			template <int W, typename Metric> void RandomSearch(
+				const cv::Vec2i& target,
+				cv::Vec2i& ref,		// in: current match, out: best match
+				float& cost,		// in: current cost, out: best cost
+				const uint32_t sweep,
 				const float scAlpha,
 				const float acAlpha,
 				const float thDist,
-				const int maxRandSearchItr
+				const PixMixParams& params
 			);
+
+			// hole rows [begin, end) in sweep order; begin == 0 starts a new sweep
+			template <int W, typename Metric> int FwdUpdate(const PixMixParams& params, const float thDist, int begin, int end);
+			template <int W, typename Metric> int BwdUpdate(const PixMixParams& params, const float thDist, int begin, int end);
 		};
 
 		inline cv::Mat3b* OneLvPixMix::GetColorPtr()
@@ -92,23 +229,57 @@ namespace dr
 		{
 			return &(mMask[WO_BORDER]);
 		}
-		inline cv::Mat2i* OneLvPixMix::GetPosMapPtr()
+		inline cv::Mat2s* OneLvPixMix::GetPosMapPtr()
 		{
 			return &mPosMap[WO_BORDER];
 		}
-		inline cv::Mat1f* OneLvPixMix::GetCostMapPtr()
+		inline cv::Mat1w* OneLvPixMix::GetCostMapPtr()
 		{
 			return &mCostMap;
 		}
 
-		inline cv::Vec2i OneLvPixMix::GetValidRandPos()
+		inline cv::Vec2s OneLvPixMix::GetPos(int r, int c) const
+		{
+			return holeRect.contains(cv::Point(c, r)) ? mPosMap[WO_BORDER](r - holeRect.y, c - holeRect.x) : cv::Vec2s(short(r), short(c));
+		}
+
+		inline cv::Vec2s& OneLvPixMix::PosAt(int r, int c)
+		{
+			return mPosMap[W_BORDER](r - holeRect.y + borderSizePosMap, c - holeRect.x + borderSizePosMap);
+		}
+
+		inline cv::Vec2i OneLvPixMix::GetValidRandPos(uint32_t rnd)
+		{
+			// the k-th valid pixel in O(1): the rows above invalidRect, the rows beside it, the rows below it, then the list
+			const int cols = mMask[WO_BORDER].cols;
+			const int k = Philox4x32::ToRange(rnd, numOutsideValid + int(vBoxValidIdx.size()));
+			if (k >= numOutsideValid)
+			{
+				const int idx = vBoxValidIdx[k - numOutsideValid];
+				return cv::Vec2i(idx / cols, idx % cols);
+			}
+
+			const int above = invalidRect.y * cols;
+			const int sideCols = cols - invalidRect.width;
+			const int beside = invalidRect.height * sideCols;
+			if (k < above) return cv::Vec2i(k / cols, k % cols);
+			if (k < above + beside)
+			{
+				const int c = (k - above) % sideCols;
+				return cv::Vec2i(invalidRect.y + (k - above) / sideCols, c < invalidRect.x ? c : c + invalidRect.width);
+			}
+			return cv::Vec2i(invalidRect.br().y + (k - above - beside) / cols, (k - above - beside) % cols);
+		}
+
+		inline void OneLvPixMix::WaitForRow(int r, int numCols)
 		{
-			cv::Vec2i p;
-			do {
-				p = cv::Vec2i(rRand(mt), cRand(mt));
-			} while (mMask[WO_BORDER](p) != 255);
+			while (rowProgress[r].load(std::memory_order_acquire) < numCols) std::this_thread::yield();
+		}
 
-			return p;
+		inline bool OneLvPixMix::ChangedRecently(ushort stamp, uint32_t sweep)
+		{
+			// a stamp that wrapped around can only look too recent, which just costs a re-evaluation
+			return ushort(sweep - stamp) < 2;
 		}
 	}
 }
\ No newline at end of file
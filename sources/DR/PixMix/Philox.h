@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+namespace dr
+{
+	namespace det
+	{
+		// Philox4x32-10 counter-based random number generator (J. K. Salmon et al., SC 2011)
+		// The output is a pure function of the key and the counter, i.e., a pixel can draw its own
+		// random numbers without any shared state and independently of which thread visits it
+		class Philox4x32
+		{
+		public:
+			Philox4x32(uint32_t key0 = 0, uint32_t key1 = 0) : key0(key0), key1(key1) { }
+
+			// first word of the random block for the counter (c0, c1, c2, c3)
+			uint32_t operator()(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3) const;
+
+			// maps a random word onto [0, n) without a division
+			static inline int ToRange(uint32_t u, int n) { return int((uint64_t(u) * uint64_t(n)) >> 32); }
+
+		private:
+			uint32_t key0, key1;
+		};
+
+		inline uint32_t Philox4x32::operator()(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3) const
+		{
+			uint32_t k0 = key0, k1 = key1;
+			for (int round = 0; round < 10; ++round)
+			{
+				const uint64_t p0 = uint64_t(0xD2511F53u) * c0;
+				const uint64_t p1 = uint64_t(0xCD9E8D57u) * c2;
+				const uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+				const uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+				c1 = uint32_t(p1);
+				c3 = uint32_t(p0);
+				c0 = n0;
+				c2 = n2;
+				k0 += 0x9E3779B9u;
+				k1 += 0xBB67AE85u;
+			}
+
+			return c0;
+		}
+	}
+}
\ No newline at end of file
@@ -1,45 +1,226 @@
 #include "DR/PixMix/PixMix.h"
 
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+	// layout of a keyframe file: this header, then the sections of color (CV_8UC3), mask (CV_8U), nnf (CV_16SC2),
+	// cost (CV_16U) and corners (CV_32FC2, 1 x numCorners, as from a std::vector), each with packed rows
+	struct KeyframeFileHeader
+	{
+		char magic[4];				// "PMKF"
+		uint32_t version;
+		int32_t roi[4];				// x, y, width and height in the frame
+		int32_t numCorners;
+		int32_t reserved;
+		double rvec[3], tvec[3];	// marker pose
+		uint64_t offsets[5];		// of the sections from the file start
+		uint64_t fileSize;
+	};
+
+	const char keyframeMagic[4] = { 'P', 'M', 'K', 'F' };
+	const uint32_t keyframeVersion = 1;
+	const uint64_t keyframeAlign = 64;
+	const int keyframeSectionTypes[5] = { CV_8UC3, CV_8U, CV_16SC2, CV_16U, CV_32FC2 };
+
+	// fills in offsets and fileSize from roi and numCorners
+	void CalcKeyframeLayout(KeyframeFileHeader& header)
+	{
+		const uint64_t numPixels = uint64_t(header.roi[2]) * uint64_t(header.roi[3]);
+		uint64_t offset = sizeof(KeyframeFileHeader);
+		for (int idx = 0; idx < 5; ++idx)
+		{
+			offset = (offset + keyframeAlign - 1) / keyframeAlign * keyframeAlign;
+			header.offsets[idx] = offset;
+			offset += (idx < 4 ? numPixels : uint64_t(header.numCorners)) * CV_ELEM_SIZE(keyframeSectionTypes[idx]);
+		}
+		header.fileSize = offset;
+	}
+}
+
 namespace dr
 {
 	namespace det
 	{
-		void PixMixKeyframe::Set(cv::InputArray color, cv::InputArray mask, cv::InputArray nnf, cv::InputArray cost, cv::InputArrayOfArrays corners)
+		void PixMixKeyframe::Set(cv::InputArray color, cv::InputArray mask, cv::InputArray nnf, cv::InputArray cost, cv::InputArrayOfArrays corners, const cv::Rect& roi)
 		{
+			assert(color.size() == roi.size() && mask.size() == roi.size() && nnf.size() == roi.size() && cost.size() == roi.size());
+
 			this->color = color.getMat().clone();	// inpainted color
 			this->mask = mask.getMat().clone();
 			this->nnf = nnf.getMat().clone();
 			this->cost = cost.getMat().clone();
 			this->corners = corners.getMat().clone();
+			this->roi = roi;
+			storage.release();
+		}
+
+		bool PixMixKeyframe::Save(const std::string& fileName, const cv::Vec3d& rvec, const cv::Vec3d& tvec) const
+		{
+			if (IsEmpty())
+			{
+				std::cerr << "[PixMixKeyframe::Save] The keyframe is empty" << std::endl;
+				return false;
+			}
+
+			cv::Mat cornersF;
+			corners.reshape(2, 1).convertTo(cornersF, CV_32F);
+
+			KeyframeFileHeader header;
+			std::memset(&header, 0, sizeof(header));
+			std::memcpy(header.magic, keyframeMagic, sizeof(keyframeMagic));
+			header.version = keyframeVersion;
+			header.roi[0] = roi.x; header.roi[1] = roi.y; header.roi[2] = roi.width; header.roi[3] = roi.height;
+			header.numCorners = cornersF.cols;
+			for (int idx = 0; idx < 3; ++idx)
+			{
+				header.rvec[idx] = rvec[idx];
+				header.tvec[idx] = tvec[idx];
+			}
+			CalcKeyframeLayout(header);
+
+			std::vector<char> buf(size_t(header.fileSize), 0);
+			std::memcpy(buf.data(), &header, sizeof(header));
+			const cv::Mat* sections[5] = { &color, &mask, &nnf, &cost, &cornersF };
+			for (int idx = 0; idx < 5; ++idx)
+			{
+				const cv::Mat& sec = *sections[idx];
+				assert(sec.type() == keyframeSectionTypes[idx]);
+				const size_t rowSize = sec.cols * sec.elemSize();
+				for (int r = 0; r < sec.rows; ++r) std::memcpy(buf.data() + header.offsets[idx] + r * rowSize, sec.ptr(r), rowSize);
+			}
+
+			std::ofstream ofs(fileName, std::ios::binary);
+			if (!ofs)
+			{
+				std::cerr << "[PixMixKeyframe::Save] Failed to open " << fileName << std::endl;
+				return false;
+			}
+			ofs.write(buf.data(), buf.size());
+
+			return ofs.good();
 		}
 
-		const void PixMixKeyframe::GetWarped(cv::InputArray corners, cv::OutputArray warpedColor, cv::OutputArray warpedNNF, cv::OutputArray warpedCost)
+		bool PixMixKeyframe::Load(const std::string& fileName, cv::Vec3d& rvec, cv::Vec3d& tvec)
 		{
-			cv::Matx33f H = cv::findHomography(this->corners, corners);
+			std::ifstream ifs(fileName, std::ios::binary | std::ios::ate);
+			if (!ifs)
+			{
+				std::cerr << "[PixMixKeyframe::Load] " << fileName << " does not exist!" << std::endl;
+				return false;
+			}
+			const std::streamoff size = ifs.tellg();
+			ifs.seekg(0);
+
+			// the sections stay in the file contents, which live as long as the keyframe
+			cv::Mat buf(1, int(size), CV_8U);
+			if (!ifs.read(reinterpret_cast<char*>(buf.data), size) || !FromBuffer(buf.data, size_t(size), rvec, tvec))
+			{
+				std::cerr << "[PixMixKeyframe::Load] Failed to read " << fileName << std::endl;
+				return false;
+			}
+			storage = buf;
 
-			cv::Mat tmpNNF;
-			cv::warpPerspective(color, warpedColor, H, color.size(), cv::INTER_LINEAR);
-			cv::warpPerspective(nnf, tmpNNF, H, color.size(), cv::INTER_NEAREST);
-			cv::warpPerspective(cost, warpedCost, H, color.size(), cv::INTER_NEAREST);
+			return true;
+		}
 
-			// warp each pixel position in "nnf"
-			for (int r = 0; r < tmpNNF.rows; ++r)
+		bool PixMixKeyframe::FromBuffer(const void* data, size_t size, cv::Vec3d& rvec, cv::Vec3d& tvec)
+		{
+			KeyframeFileHeader header;
+			if (size < sizeof(header)) return false;
+			std::memcpy(&header, data, sizeof(header));
+			if (std::memcmp(header.magic, keyframeMagic, sizeof(keyframeMagic)) != 0 || header.version != keyframeVersion)
 			{
-				auto nnfPtr = tmpNNF.ptr<cv::Vec2i>(r);
-				for (int c = 0; c < tmpNNF.cols; ++c)
+				std::cerr << "[PixMixKeyframe::FromBuffer] Not a keyframe of version " << keyframeVersion << std::endl;
+				return false;
+			}
+
+			// the offsets must be the ones of this version and within the buffer
+			KeyframeFileHeader expected = header;
+			if (header.roi[2] <= 0 || header.roi[3] <= 0 || header.numCorners <= 0) return false;
+			CalcKeyframeLayout(expected);
+			if (std::memcmp(expected.offsets, header.offsets, sizeof(header.offsets)) != 0 || header.fileSize != expected.fileSize || size < header.fileSize) return false;
+			if (reinterpret_cast<uintptr_t>(data) % sizeof(float) != 0) return false;	// the sections are read in place
+
+			uchar* base = static_cast<uchar*>(const_cast<void*>(data));	// never written
+			const int w = header.roi[2], h = header.roi[3];
+			color = cv::Mat(h, w, keyframeSectionTypes[0], base + header.offsets[0]);
+			mask = cv::Mat(h, w, keyframeSectionTypes[1], base + header.offsets[1]);
+			nnf = cv::Mat(h, w, keyframeSectionTypes[2], base + header.offsets[2]);
+			cost = cv::Mat(h, w, keyframeSectionTypes[3], base + header.offsets[3]);
+			corners = cv::Mat(1, header.numCorners, keyframeSectionTypes[4], base + header.offsets[4]);
+			roi = cv::Rect(header.roi[0], header.roi[1], w, h);
+			storage.release();
+
+			rvec = cv::Vec3d(header.rvec[0], header.rvec[1], header.rvec[2]);
+			tvec = cv::Vec3d(header.tvec[0], header.tvec[1], header.tvec[2]);
+
+			return true;
+		}
+
+		const void PixMixKeyframe::GetWarped(cv::InputArray corners, const cv::Rect& dstRoi, cv::OutputArray warpedColor, cv::OutputArray warpedNNF, cv::OutputArray warpedCost)
+		{
+			const cv::Matx33d H = cv::findHomography(this->corners, corners);
+			// the same mapping from the pixels of roi to the pixels of dstRoi
+			const cv::Matx33d Hroi = cv::Matx33d(1.0, 0.0, -dstRoi.x, 0.0, 1.0, -dstRoi.y, 0.0, 0.0, 1.0) * H * cv::Matx33d(1.0, 0.0, roi.x, 0.0, 1.0, roi.y, 0.0, 0.0, 1.0);
+
+			cv::warpPerspective(color, warpedColor, Hroi, dstRoi.size(), cv::INTER_LINEAR);
+
+			// nearest-neighbour warp of "nnf" and "cost" fused with the warp of each pixel position in "nnf";
+			// pixels mapped from outside of the keyframe get an off-frame position and zero cost
+			const cv::Matx33d HroiInv = Hroi.inv();
+			cv::Mat2s tmpNNF(dstRoi.size());
+			cv::Mat1w tmpCost(dstRoi.size());
+			util::ParallelRows(dstRoi.height, dstRoi.width, [&](int rBegin, int rEnd)
+			{
+				for (int r = rBegin; r < rEnd; ++r)
 				{
-					auto pt = H * cv::Point3f(float(nnfPtr[c][1]), float(nnfPtr[c][0]), 1.0f);
-					nnfPtr[c][0] = int(pt.y / pt.z + 0.5f);
-					nnfPtr[c][1] = int(pt.x / pt.z + 0.5f);
+					auto nnfPtr = tmpNNF.ptr<cv::Vec2s>(r);
+					auto costPtr = tmpCost.ptr<ushort>(r);
+					for (int c = 0; c < dstRoi.width; ++c)
+					{
+						const cv::Vec3d src = HroiInv * cv::Vec3d(c, r, 1.0);
+						const double srcX = src[0] / src[2], srcY = src[1] / src[2];
+						if (!(src[2] > 0.0) || !(srcX > -0.5 && srcX < nnf.cols - 0.5 && srcY > -0.5 && srcY < nnf.rows - 0.5))
+						{
+							nnfPtr[c] = cv::Vec2s(-1, -1);
+							costPtr[c] = 0;
+							continue;
+						}
+						const int srcC = cvRound(srcX), srcR = cvRound(srcY);
+
+						const cv::Vec2s& ref = nnf.at<cv::Vec2s>(srcR, srcC);
+						const cv::Vec3d pt = H * cv::Vec3d(ref[1], ref[0], 1.0);
+						// saturated positions stay out of the frame and get re-sampled by the caller
+						nnfPtr[c][0] = cv::saturate_cast<short>(pt[1] / pt[2]);
+						nnfPtr[c][1] = cv::saturate_cast<short>(pt[0] / pt[2]);
+						costPtr[c] = cost.at<ushort>(srcR, srcC);
+					}
 				}
-			}
+			});
 
 			tmpNNF.copyTo(warpedNNF);
+			tmpCost.copyTo(warpedCost);
 		}
 	}
 
-	PixMix::PixMix() : terminate(false), done(true) { }
-	PixMix::~PixMix() { }
+	PixMix::PixMix() : hasJob(false), running(false), shutdown(false), terminate(false), done(true) { }
+
+	PixMix::~PixMix()
+	{
+		if (th.joinable())
+		{
+			jobMtx.lock();
+			shutdown = true;
+			terminate.store(true);
+			jobMtx.unlock();
+			jobCv.notify_all();
+			th.join();
+		}
+	}
 
 	void PixMix::Run(cv::InputArray color, cv::InputArray mask, cv::OutputArray inpainted, cv::OutputArray nnf, cv::OutputArray cost, const det::PixMixParams& params, bool debugViz)
 	{
@@ -47,33 +228,37 @@ namespace dr
 		assert(color.type() == CV_8UC3);
 		assert(mask.type() == CV_8U);
 
-		done.store(false);
-
-		copyMtx.lock();
 		std::cout << "[PixMix::Run] Inpainting has started!" << std::endl;
-		color.copyTo(intermidColor);
-		copyMtx.unlock();
+		color.copyTo(intermidColor.Back());
+		intermidColor.Publish();
 
 		auto tmpParams = params;
-		BuildPyrm(color, mask, tmpParams.maxPyrmLv);
+		BuildPyrm(color, mask, tmpParams);
+		vUsedItrs.assign(pm.size(), 0);
+		vLvMs.assign(pm.size(), 0.0);
 
 		for (int lv = int(pm.size()) - 1; lv >= 0 && !terminate.load(); --lv)
 		{
 			if (lv == 0) tmpParams.maxItr = std::min(tmpParams.maxItr, 2);
 
-			pm[lv].Run(tmpParams);
+			const auto start = std::chrono::steady_clock::now();
+			pm[lv].SetCancelFlag(&terminate);
+			vUsedItrs[lv] = pm[lv].Run(tmpParams);
+			vLvMs[lv] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (terminate.load()) break;
 			if (lv > 0) FillInLowerLv(pm[lv], pm[lv - 1]);
 
-			copyMtx.lock();
-			cv::resize(*pm[lv].GetColorPtr(), intermidColor, color.size(), 0.0f, 0.0f, cv::INTER_LINEAR);
-			copyMtx.unlock();
+			cv::resize(*pm[lv].GetColorPtr(), intermidColor.Back(), color.size(), 0.0f, 0.0f, cv::INTER_LINEAR);
+			intermidColor.Publish();
 
 #pragma region DEBUG_VIZ
 			if (debugViz)
 			{
 				cv::Mat vizColor, vizPosMap;
 				cv::resize(*pm[lv].GetColorPtr(), vizColor, color.size(), 0.0f, 0.0f, cv::INTER_NEAREST);
-				util::CreateVizPosMap(*pm[lv].GetPosMapPtr(), vizPosMap);
+				cv::Mat posMap;
+				pm[lv].GetPosMap(cv::Rect(cv::Point(0, 0), pm[lv].GetColorPtr()->size()), posMap);
+				util::CreateVizPosMap(posMap, vizPosMap);
 				cv::resize(vizPosMap, vizPosMap, color.size(), 0.0f, 0.0f, cv::INTER_NEAREST);
 				cv::imshow("debug - inpainted color", vizColor);
 				cv::imshow("debug - colord position map", vizPosMap);
@@ -82,60 +267,89 @@ namespace dr
 #pragma endregion
 		}
 
-		BlendBorder(color, mask, inpainted, tmpParams.blurSize);
-		copyMtx.lock();
-		inpainted.copyTo(intermidColor);
-		copyMtx.unlock();
-
-		pm[0].GetPosMapPtr()->copyTo(nnf);
-		pm[0].GetCostMapPtr()->copyTo(cost);
-
-		done.store(true);
+		if (terminate.load())
+		{
+			// partial levels: nothing is published
+			std::cout << "[PixMix::Run] Cancelled" << std::endl;
+			return;
+		}
 
-		copyMtx.lock();
-		std::cout << "[PixMix::Run] Finished the inpainting!" << std::endl;
-		copyMtx.unlock();
+		util::BlendBorder(color, mask, *pm[0].GetColorPtr(), tmpParams.blurSize, inpainted, pm[0].InvalidRect());
+		inpainted.copyTo(intermidColor.Back());
+		intermidColor.Publish();
+
+		// full-size maps composed from the hole box of the solver
+		const cv::Rect frameRect(cv::Point(0, 0), color.size());
+		pm[0].GetPosMap(frameRect, nnf);
+		pm[0].GetCostMap(frameRect, cost);
+
+		// one write so that the lines of several instances do not interleave
+		std::ostringstream oss;
+		oss << "[PixMix::Run] Finished the inpainting! Iterations per level:";
+		for (int lv = int(vUsedItrs.size()) - 1; lv >= 0; --lv) oss << " " << vUsedItrs[lv];
+		oss << "\n";
+		std::cout << oss.str() << std::flush;
 	}
 
-	void PixMix::Run(cv::InputArray color, cv::InputArray mask, const det::PixMixKeyframe& ref, cv::OutputArray inpainted, const det::PixMixParams& params)
+	void PixMix::Run(cv::InputArray color, cv::InputArray mask, const det::PixMixKeyframe& ref, cv::OutputArray inpainted, cv::OutputArray nnf, cv::OutputArray cost, const det::PixMixParams& params, cv::InputArray candNNF)
 	{
 		assert(color.size() == mask.size());
 		assert(color.type() == CV_8UC3);
 		assert(mask.type() == CV_8U);
 
-		ref.Color().copyTo(*pm[0].GetColorPtr());
-		ref.NNF().copyTo(*pm[0].GetPosMapPtr());
-		ref.Cost().copyTo(*pm[0].GetCostMapPtr());
-
-		pm[0].Run(params);
-
-		BlendBorder(color, mask, inpainted, params.blurSize);
+		// the keyframe covers its ROI only: the frame elsewhere, and the hole from the keyframe
+		// (the costs are not copied since Run re-evaluates them all)
+		const cv::Rect& roi = ref.Roi();
+		assert((roi & cv::Rect(cv::Point(0, 0), color.size())) == roi);
+		if (pm.empty() || pm[0].GetColorPtr()->size() != color.size())
+		{
+			// first frame of this size (e.g. a new rectified resolution): the whole level is initialized
+			if (pm.empty()) pm.resize(1);
+			pm[0].Init(cv::Mat3b(color.getMat()), cv::Mat1b(mask.getMat()), params.seed, 0);
+		}
+		else
+		{
+			pm[0].SetMask(mask.getMat());
+			color.copyTo(*pm[0].GetColorPtr());
+		}
+		ref.Color().copyTo((*pm[0].GetColorPtr())(roi), ref.Mask() == 0);
+		pm[0].SetPosMap(ref.NNF(), roi);
+		if (!candNNF.empty()) pm[0].SetCandidatePosMap(candNNF, roi);
+
+		const auto start = std::chrono::steady_clock::now();
+		pm[0].SetCancelFlag(nullptr);
+		vUsedItrs.assign(1, pm[0].Run(params));
+		vLvMs.assign(1, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+		util::BlendBorder(color, mask, *pm[0].GetColorPtr(), params.blurSize, inpainted, pm[0].InvalidRect());
+		if (nnf.needed()) pm[0].GetPosMap(roi, nnf);
+		if (cost.needed()) pm[0].GetCostMap(roi, cost);
 	}
 
-	void PixMix::BuildPyrm(cv::InputArray color, cv::InputArray mask, const int maxPyrmLv)
+	void PixMix::BuildPyrm(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params)
 	{
-		pm.resize(CalcPyrmLv(color.cols(), color.rows(), maxPyrmLv));
-		pm[0].Init(color.getMat(), mask.getMat());
+		// level buffers persist and are only reallocated when the frame size or the depth changes
+		pm.resize(CalcPyrmLv(color.cols(), color.rows(), params.maxPyrmLv));
+		vLvMask.resize(pm.size());
+
+		pm[0].Allocate(color.size());
+		colorUpsampled.create(color.size());
+		color.copyTo(*(pm[0].GetColorPtr()));
+		pm[0].SetMask(mask.getMat());
+		pm[0].Init(params.seed, 0);
 		for (int lv = 1; lv < pm.size(); ++lv)
 		{
 			auto lvSize = pm[lv - 1].GetColorPtr()->size() / 2;
+			pm[lv].Allocate(lvSize);
 
-			// color
-			cv::Mat3b tmpColor;
-			cv::resize(*(pm[lv - 1].GetColorPtr()), tmpColor, lvSize, 0.0, 0.0, cv::INTER_LINEAR);
-			// mask
-			cv::Mat1b tmpMask;
-			cv::resize(*(pm[lv - 1].GetMaskPtr()), tmpMask, lvSize, 0.0, 0.0, cv::INTER_LINEAR);
-			for (int r = 0; r < tmpMask.rows; ++r)
-			{
-				auto ptrMask = tmpMask.ptr<uchar>(r);
-				for (int c = 0; c < tmpMask.cols; ++c)
-				{
-					ptrMask[c] = ptrMask[c] < 255 ? 0 : 255;
-				}
-			}
+			// color (straight into the level buffer)
+			cv::resize(*(pm[lv - 1].GetColorPtr()), *(pm[lv].GetColorPtr()), lvSize, 0.0, 0.0, cv::INTER_LINEAR);
+			// mask (any partially masked pixel stays masked)
+			cv::resize(*(pm[lv - 1].GetMaskPtr()), vLvMask[lv], lvSize, 0.0, 0.0, cv::INTER_LINEAR);
+			cv::threshold(vLvMask[lv], vLvMask[lv], 254.0, 255.0, cv::THRESH_BINARY);
+			pm[lv].SetMask(vLvMask[lv]);
 
-			pm[lv].Init(tmpColor, tmpMask);
+			pm[lv].Init(params.seed, lv);
 		}
 	}
 
@@ -150,100 +364,211 @@ namespace dr
 
 	void PixMix::FillInLowerLv(det::OneLvPixMix& pmUpper, det::OneLvPixMix& pmLower)
 	{
-		cv::Mat colorUpsampled;
-		cv::resize(*(pmUpper.GetColorPtr()), colorUpsampled, pmLower.GetColorPtr()->size(), 0.0, 0.0, cv::INTER_LINEAR);
-		cv::Mat posMapUpsampled;
-		cv::resize(*(pmUpper.GetPosMapPtr()), posMapUpsampled, pmLower.GetPosMapPtr()->size(), 0.0, 0.0, cv::INTER_NEAREST);
-		for (int r = 0; r < posMapUpsampled.rows; ++r)
-		{
-			auto ptr = posMapUpsampled.ptr<cv::Vec2i>(r);
-			for (int c = 0; c < posMapUpsampled.cols; ++c) ptr[c] = ptr[c] * 2 + cv::Vec2i(r % 2, c % 2);
-		}
+		// a view of the level-0 sized scratch buffer (BuildPyrm), so that no level allocates
+		const cv::Size upSize = pmUpper.GetColorPtr()->size(), lwSize = pmLower.GetColorPtr()->size();
+		cv::Mat3b colorUp = colorUpsampled(cv::Rect(cv::Point(0, 0), lwSize));
+		cv::resize(*(pmUpper.GetColorPtr()), colorUp, lwSize, 0.0, 0.0, cv::INTER_LINEAR);
 
 		auto colorLw = *(pmLower.GetColorPtr());
 		auto maskLw = *(pmLower.GetMaskPtr());
 		auto posMapLw = *(pmLower.GetPosMapPtr());
+		const cv::Rect& holeLw = pmLower.HoleRect();
 
-		const int wLw = pmLower.GetColorPtr()->cols;
-		const int hLw = pmLower.GetColorPtr()->rows;
-		for (int r = 0; r < hLw; ++r)
+		// only the hole box of the lower level is visited; the upper position is the one cv::INTER_NEAREST would pick
+		const double scaleX = 1.0 / (double(lwSize.width) / upSize.width), scaleY = 1.0 / (double(lwSize.height) / upSize.height);
+		util::ParallelRows(holeLw.height, holeLw.width, [&](int rBegin, int rEnd)
 		{
-			auto ptrColorLw = colorLw.ptr<cv::Vec3b>(r);
-			auto ptrColorUpsampled = colorUpsampled.ptr<cv::Vec3b>(r);
-			auto ptrMaskLw = maskLw.ptr<uchar>(r);
-			auto ptrPosMapLw = posMapLw.ptr<cv::Vec2i>(r);
-			auto ptrPosMapUpsampled = posMapUpsampled.ptr<cv::Vec2i>(r);
-			for (int c = 0; c < wLw; ++c)
+			for (int r = holeLw.y + rBegin; r < holeLw.y + rEnd; ++r)
 			{
-				if (ptrMaskLw[c] == 0)
+				const int rUp = std::min(cvFloor(r * scaleY), upSize.height - 1);
+				auto ptrColorLw = colorLw.ptr<cv::Vec3b>(r);
+				auto ptrColorUpsampled = colorUp.ptr<cv::Vec3b>(r);
+				auto ptrMaskLw = maskLw.ptr<uchar>(r);
+				auto ptrPosMapLw = posMapLw.ptr<cv::Vec2s>(r - holeLw.y);
+				for (int c = holeLw.x; c < holeLw.x + holeLw.width; ++c)
 				{
-					ptrColorLw[c] = ptrColorUpsampled[c];
-					ptrPosMapLw[c] = ptrPosMapUpsampled[c];
+					if (ptrMaskLw[c] == 0)
+					{
+						// upsampled position (fused with the copy; only hole pixels need it)
+						const cv::Vec2s posUp = pmUpper.GetPos(rUp, std::min(cvFloor(c * scaleX), upSize.width - 1));
+						ptrColorLw[c] = ptrColorUpsampled[c];
+						ptrPosMapLw[c - holeLw.x] = cv::Vec2s(short(posUp[0] * 2 + r % 2), short(posUp[1] * 2 + c % 2));
+					}
 				}
 			}
-		}
+		});
 	}
 
-	void PixMix::BlendBorder(cv::InputArray color, cv::InputArray mask, cv::OutputArray dst, int blurSize)
+#pragma region TIME_SLICING
+	void PixMix::BeginSteps(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params)
 	{
-		cv::Mat  alphaMask;
-		cv::blur(mask, alphaMask, cv::Size(blurSize, blurSize));
+		assert(color.size() == mask.size());
+		assert(color.type() == CV_8UC3);
+		assert(mask.type() == CV_8U);
 
-		cv::Mat3f colorF, ipColorF, dstColorF(pm[0].GetColorPtr()->size());
-		color.getMat().convertTo(colorF, CV_32FC3, 1.0 / 255.0);
-		pm[0].GetColorPtr()->convertTo(ipColorF, CV_32FC3, 1.0 / 255.0);
+		std::cout << "[PixMix::BeginSteps] Inpainting has started!" << std::endl;
+		color.copyTo(stepColor);
+		mask.copyTo(stepMask);
+		color.copyTo(intermidColor.Back());
+		intermidColor.Publish();
+
+		step = StepState();
+		step.params = params;
+		BuildPyrm(stepColor, stepMask, step.params);
+		vUsedItrs.assign(pm.size(), 0);
+		vLvMs.assign(pm.size(), 0.0);
+		step.lv = int(pm.size()) - 1;
+		step.stage = StepState::LEVEL_BEGIN;
+		done.store(false);
+	}
 
-		cv::Mat1f mAlphaF;
-		alphaMask.convertTo(mAlphaF, CV_32F, 1.0 / 255.0);
+	bool PixMix::Step(std::chrono::microseconds budget)
+	{
+		using Clock = std::chrono::steady_clock;
+		const auto deadline = Clock::now() + budget;
 
-		for (int r = 0; r < color.rows(); ++r)
+		// the preparation and the end of a level run whole; the sweeps are cut into row slices
+		while (step.stage != StepState::FINISHED)
 		{
-			auto ptrSrc = colorF.ptr<cv::Vec3f>(r);
-			auto ptrPM = ipColorF.ptr<cv::Vec3f>(r);
-			auto ptrDst = dstColorF.ptr<cv::Vec3f>(r);
-			auto ptrAlpha = mAlphaF.ptr<float>(r);
-			for (int c = 0; c < color.cols(); ++c)
+			const int lv = step.lv;
+			const auto stageStart = Clock::now();
+			det::OneLvPixMix& level = pm[lv];
+			switch (step.stage)
+			{
+			case StepState::LEVEL_BEGIN:
+				if (step.lv == 0) step.params.maxItr = std::min(step.params.maxItr, 2);
+				level.SetCancelFlag(nullptr);
+				level.BeginSolve(step.params);
+				step.itr = 0;
+				step.rowCursor = 0;
+				step.numChanged = 0;
+				step.stage = step.params.maxItr > 0 ? StepState::FWD_SWEEP : StepState::LEVEL_END;
+				break;
+
+			case StepState::FWD_SWEEP:
+			case StepState::BWD_SWEEP:
 			{
-				ptrDst[c] = ptrAlpha[c] * ptrSrc[c] + (1.0f - ptrAlpha[c]) * ptrPM[c];
+				// as many rows as fit in the rest of the budget at the measured speed (one row until measured)
+				const bool forward = step.stage == StepState::FWD_SWEEP;
+				const double restUs = std::chrono::duration<double, std::micro>(deadline - Clock::now()).count();
+				const int fit = step.usPerRow > 0.0 ? int(restUs / step.usPerRow) : 1;
+				const int numRows = std::min(level.NumHoleRows() - step.rowCursor, std::max(fit, 1));
+
+				const auto start = Clock::now();
+				step.numChanged += level.SweepRows(step.params, forward, step.rowCursor, step.rowCursor + numRows);
+				if (numRows > 0)
+				{
+					const double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numRows;
+					step.usPerRow = step.usPerRow > 0.0 ? 0.5 * (step.usPerRow + us) : us;
+				}
+				step.rowCursor += numRows;
+				if (step.rowCursor < level.NumHoleRows()) break;
+
+				step.rowCursor = 0;
+				if (forward)
+				{
+					step.stage = StepState::BWD_SWEEP;
+					break;
+				}
+				const bool levelDone = level.EndIteration(step.params, step.itr, step.numChanged);
+				++step.itr;
+				step.numChanged = 0;
+				step.stage = levelDone ? StepState::LEVEL_END : StepState::FWD_SWEEP;
+				break;
+			}
+
+			case StepState::LEVEL_END:
+				vUsedItrs[step.lv] = step.itr;
+				if (step.lv > 0)
+				{
+					FillInLowerLv(level, pm[step.lv - 1]);
+					cv::resize(*level.GetColorPtr(), intermidColor.Back(), stepColor.size(), 0.0f, 0.0f, cv::INTER_LINEAR);
+					intermidColor.Publish();
+					--step.lv;
+					step.stage = StepState::LEVEL_BEGIN;
+					break;
+				}
+
+				util::BlendBorder(stepColor, stepMask, *level.GetColorPtr(), step.params.blurSize, stepInpainted, level.InvalidRect());
+				stepInpainted.copyTo(intermidColor.Back());
+				intermidColor.Publish();
+				step.stage = StepState::FINISHED;
+				done.store(true);
+				std::cout << "[PixMix::Step] Finished the inpainting!" << std::endl;
+				break;
+
+			default:
+				break;
 			}
+
+			const auto now = Clock::now();
+			vLvMs[lv] += std::chrono::duration<double, std::milli>(now - stageStart).count();
+			if (now >= deadline) break;
 		}
 
-		dstColorF.convertTo(dst, CV_8UC3, 255.0);
+		return step.stage == StepState::FINISHED;
 	}
-
+#pragma endregion
 
 #pragma region MULTITHREADING
-	std::mutex PixMix::copyMtx;
+	void PixMix::MtRun(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params)
+	{
+		std::lock_guard<std::mutex> lock(jobMtx);
+		if (!th.joinable()) th = std::thread(&PixMix::WorkerLoop, this);
+
+		// keep the color and mask to make them accessible for PixMix anytime
+		color.copyTo(jobColor);
+		mask.copyTo(jobMask);
+		jobParams = params;
+		hasJob = true;
+		done.store(false);
+		jobCv.notify_all();
+	}
 
-	void PixMix::MtRun(cv::InputArray color, cv::InputArray mask, cv::OutputArray inpainted, const det::PixMixParams& params)
+	void PixMix::WorkerLoop()
 	{
-		if (done.load())
+		std::unique_lock<std::mutex> lock(jobMtx);
+		while (true)
 		{
-			StopMt();
-
-			// keep the color and mask to make them accessible for PixMix anytime
-			color.copyTo(mtColor); mask.copyTo(mtMask);
-
-			th = std::thread([=] { Run(mtColor, mtMask, inpainted, mtNNF, mtCost, params, false); });
+			jobCv.wait(lock, [&] { return hasJob || shutdown; });
+			if (shutdown) return;
+
+			// take the latest job; its buffers are swapped so that the next MtRun reuses the old ones
+			std::swap(mtColor, jobColor);
+			std::swap(mtMask, jobMask);
+			const det::PixMixParams params = jobParams;
+			hasJob = false;
+			running = true;
+			terminate.store(false);
+			lock.unlock();
+
+			Run(mtColor, mtMask, mtInpainted, mtNNF, mtCost, params, false);
+
+			lock.lock();
+			running = false;
+			if (!hasJob) done.store(true);
+			jobCv.notify_all();
 		}
 	}
 
 	bool PixMix::GetIntermidColor(cv::OutputArray color)
 	{
-		copyMtx.lock();
-		if (!intermidColor.empty()) intermidColor.copyTo(color);
-		copyMtx.unlock();
+		const cv::Mat& latest = intermidColor.Fetch();
+		if (!latest.empty()) latest.copyTo(color);
 
-		return !intermidColor.empty();
+		return !latest.empty();
 	}
 
 	void PixMix::StopMt()
 	{
-		std::cout << "[PixMix::StopMt] Joining the thread..." << std::endl;
+		std::cout << "[PixMix::StopMt] Cancelling the jobs..." << std::endl;
+		std::unique_lock<std::mutex> lock(jobMtx);
+		hasJob = false;
 		terminate.store(true);
-		if (th.joinable()) th.join();
+		jobCv.wait(lock, [&] { return !running; });
+		done.store(true);
 		terminate.store(false);
-		std::cout << "[PixMix::StopMt] The thread has been joined!" << std::endl;
+		std::cout << "[PixMix::StopMt] The worker is idle!" << std::endl;
 	}
 
 	bool PixMix::IsDone()
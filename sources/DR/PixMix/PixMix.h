@@ -1,8 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include "OneLvPixMix.h"
 
 namespace dr
@@ -12,8 +15,10 @@ namespace dr
 		class PixMixKeyframe
 		{
 		public:
-			void Set(cv::InputArray color, cv::InputArray mask, cv::InputArray nnf, cv::InputArray cost, cv::InputArrayOfArrays corners);
-			const void GetWarped(cv::InputArray corners, cv::OutputArray warpedColor, cv::OutputArray warpedNNF, cv::OutputArray warpedCost);
+			// color, mask, nnf and cost are the crops at roi; nnf still holds absolute frame positions
+			void Set(cv::InputArray color, cv::InputArray mask, cv::InputArray nnf, cv::InputArray cost, cv::InputArrayOfArrays corners, const cv::Rect& roi);
+			// warps the keyframe onto dstRoi of the view given by corners (outputs are dstRoi sized)
+			const void GetWarped(cv::InputArray corners, const cv::Rect& dstRoi, cv::OutputArray warpedColor, cv::OutputArray warpedNNF, cv::OutputArray warpedCost);
 
 			inline const bool IsEmpty() const { return color.empty(); }
 			inline const cv::Mat& Color() const { return color; }
@@ -21,9 +26,19 @@ namespace dr
 			inline const cv::Mat& NNF() const { return nnf; }
 			inline const cv::Mat& Cost() const { return cost; }
 			inline const cv::Mat& Corners() const { return corners; }
+			inline const cv::Rect& Roi() const { return roi; }
+
+			// Binary keyframe file with the marker pose (versioned, native endianness). Every section starts
+			// at a multiple of 64 bytes from the file start so that a memory-mapped file can be used in place.
+			bool Save(const std::string& fileName, const cv::Vec3d& rvec, const cv::Vec3d& tvec) const;
+			bool Load(const std::string& fileName, cv::Vec3d& rvec, cv::Vec3d& tvec);
+			// wraps the contents of a keyframe file (e.g. a mapped file) without copies; data must outlive the keyframe
+			bool FromBuffer(const void* data, size_t size, cv::Vec3d& rvec, cv::Vec3d& tvec);
 
 		private:
-			cv::Mat color, mask, nnf, cost, corners;
+			cv::Mat color, mask, nnf, cost, corners;	// nnf and cost in the compact OneLvPixMix layout (cv::Mat2s, cv::Mat1w)
+			cv::Rect roi;	// in the frame
+			cv::Mat storage;	// file contents the other Mats point into (Load)
 		};
 	}
 
@@ -34,28 +49,73 @@ namespace dr
 		~PixMix();
 
 		void Run(cv::InputArray color, cv::InputArray mask, cv::OutputArray inpainted, cv::OutputArray nnf, cv::OutputArray cost, const det::PixMixParams& params, bool debugViz = false);
-		void Run(cv::InputArray color, cv::InputArray mask, const det::PixMixKeyframe& ref, cv::OutputArray inpainted, const det::PixMixParams& params);
-		
+		// nnf and cost: the refined maps of level 0 inside ref.Roi();
+		// candNNF: further matches inside ref.Roi() (e.g. of a second keyframe), each taken where it is cheaper than the one of ref
+		void Run(cv::InputArray color, cv::InputArray mask, const det::PixMixKeyframe& ref, cv::OutputArray inpainted, cv::OutputArray nnf, cv::OutputArray cost, const det::PixMixParams& params, cv::InputArray candNNF = cv::noArray());
+
+		// iterations used per pyramid level in the last Run (index 0: finest level)
+		inline const std::vector<int>& GetUsedItrs() const { return vUsedItrs; }
+		// solver time [ms] per pyramid level in the last Run (index 0: finest level)
+		inline const std::vector<double>& GetLvTimes() const { return vLvMs; }
+
 	private:
 		std::vector<det::OneLvPixMix> pm;
+		std::vector<int> vUsedItrs;
+		std::vector<double> vLvMs;
+		std::vector<cv::Mat1b> vLvMask;	// downsampled masks, kept across calls
+		cv::Mat3b colorUpsampled;		// FillInLowerLv scratch of the level-0 size, kept across calls
 
-		void BuildPyrm(cv::InputArray color, cv::InputArray mask, const int maxPyrmLv);
+		void BuildPyrm(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params);
 		int CalcPyrmLv(int width, int height, int maxPyrmLv);
 		void FillInLowerLv(det::OneLvPixMix& pmUpper, det::OneLvPixMix& pmLower);
-		void BlendBorder(cv::InputArray color, cv::InputArray mask, cv::OutputArray dst, int blurSize);
 
 #pragma region MULTITHREADING
 	public:
-		void MtRun(cv::InputArray color, cv::InputArray mask, cv::OutputArray inpainted, const det::PixMixParams& params);
+		// Queues a job for the persistent worker of this instance; a job still waiting is superseded by the newer one.
+		// The result is published through GetIntermidColor.
+		void MtRun(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params);
+		// latest intermediate result of Run; call it from one thread at a time (it never blocks on Run)
 		bool GetIntermidColor(cv::OutputArray color);
-		void StopMt();
-		bool IsDone();
+		// changes whenever Run publishes a new intermediate result
+		inline uint64_t GetIntermidGeneration() const { return intermidColor.Generation(); }
+		void StopMt();	// drops the waiting job and cancels the running one (within one row sweep); returns once idle
+		bool IsDone();	// no job running or waiting
+
+#pragma region TIME_SLICING
+	public:
+		// Run advanced in time slices on the calling thread (single-core targets; not together with MtRun).
+		// Every finished level is published through GetIntermidColor as in Run, the final result as well.
+		void BeginSteps(cv::InputArray color, cv::InputArray mask, const det::PixMixParams& params);
+		// advances the solve for about budget (at least one row slice); true once the result is complete
+		bool Step(std::chrono::microseconds budget);
 
 	private:
-		std::thread th;
+		struct StepState
+		{
+			enum Stage { LEVEL_BEGIN, FWD_SWEEP, BWD_SWEEP, LEVEL_END, FINISHED };
+			Stage stage = FINISHED;
+			int lv = 0, itr = 0;
+			int rowCursor = 0;		// next hole row of the sweep, in sweep order
+			int numChanged = 0;		// in the current iteration
+			double usPerRow = 0.0;	// measured speed of the sweeps
+			det::PixMixParams params;
+		};
+		StepState step;
+		cv::Mat stepColor, stepMask, stepInpainted;
+#pragma endregion
+
+	private:
+		std::thread th;			// started by the first MtRun and joined by the destructor
+		std::mutex jobMtx;
+		std::condition_variable jobCv;
+		bool hasJob, running, shutdown;	// guarded by jobMtx
+		cv::Mat jobColor, jobMask;	// the waiting job, guarded by jobMtx
+		det::PixMixParams jobParams;
 		std::atomic<bool> terminate, done;
-		static std::mutex copyMtx;
-		cv::Mat intermidColor, mtColor, mtMask, mtNNF, mtCost;	// for MtMarkerHiding
+		util::TripleBuffer intermidColor;
+		cv::Mat mtColor, mtMask, mtInpainted, mtNNF, mtCost;	// the running job (worker only)
+
+		void WorkerLoop();
 #pragma endregion
 	};
 }
\ No newline at end of file
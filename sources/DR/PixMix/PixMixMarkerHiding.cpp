@@ -1,82 +1,497 @@
 #include "PixMixMarkerHiding.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace dr
 {
-	PixMixMarkerHiding::PixMixMarkerHiding(const ArUcoMarker& marker, bool debugViz)
-		: markerSize(marker.Size()), markerMargin(marker.Margin()), debugViz(debugViz)
+	PixMixMarkerHiding::PixMixMarkerHiding(const ArUcoMarker& marker, bool debugViz, const det::PixMixMarkerHidingParams& mhParams)
+		: mhParams(mhParams), markerSize(marker.Size()), markerMargin(marker.Margin()), debugViz(debugViz), refreshing(false)
 	{
 	}
 
 	PixMixMarkerHiding::~PixMixMarkerHiding()
 	{
+		if (bgTh.joinable()) bgTh.join();
 	}
 
-	void PixMixMarkerHiding::Reset(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params)
+	void PixMixMarkerHiding::Reset(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params)
 	{
 		assert(corners.cols() > 0);
 
-		std::vector<cv::Point2f> newMkCors;
-		AddMarginToMarkerCorners(corners, newMkCors);
+		ClearKeyframes();
 
-		// PixMix
-		cv::Mat inpainted, nnf, cost, mask;
-		dr::util::CreateMaskFromCorners(newMkCors, color.size(), mask);
-		pm.Run(color, mask, inpainted, nnf, cost, params);
-		kf.Set(inpainted, mask, nnf, cost, corners);
+		det::PixMixKeyframe kf;
+		if (mhParams.rectSize > 0)
+		{
+			cv::Mat rectColor;
+			std::vector<cv::Point2f> rectCorners;
+			Rectify(color, corners, rectColor, rectCorners);
+			InpaintKeyframe(pm, rectColor, rectCorners, params, kf);
+		}
+		else InpaintKeyframe(pm, color, corners, params, kf);
+		AddKeyframe(kf, rvec, tvec, true);
+		prevMeanCost = CalcMeanCost(kf.Cost(), kf.Mask());
+		solved = true;
 
 		std::cout << "[PixMixMarkerHiding::Rest] Inpainted a keyframe" << std::endl;
 	}
 
-	void PixMixMarkerHiding::Run(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const det::PixMixParams& params)
+	void PixMixMarkerHiding::Run(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params)
+	{
+		solved = false;
+		if (mhParams.rectSize <= 0)
+		{
+			RunInpaint(color, inpainted, corners, rvec, tvec, params);
+			return;
+		}
+
+		// motion gating on the camera corners: the last rectified result is only warped back
+		const bool moved = rectResult.empty() || mhParams.staticMotion <= 0.0f || CalcCornerMotion(rectResultCorners, corners) > mhParams.staticMotion;
+		std::vector<cv::Point2f> rectCorners;
+		if (moved)
+		{
+			cv::Mat rectColor, rectInpainted;
+			Rectify(color, corners, rectColor, rectCorners);
+			RunInpaint(rectColor, rectInpainted, rectCorners, rvec, tvec, params);
+			if (rectInpainted.empty()) return;
+
+			rectResult = rectInpainted;
+			rectResultCorners = corners.getMat().clone();
+		}
+		else CalcRectCorners(rectCorners);
+
+		const cv::Matx33d H = cv::findHomography(rectCorners, corners);
+		CompositeWarped(color, inpainted, corners, rectResult, H, params.blurSize);
+	}
+
+	void PixMixMarkerHiding::RunInpaint(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params)
+	{
+		SwapInRefreshed();
+		if (vKeyframes.empty() || corners.size() != vKeyframes.front().kf.Corners().size()) return;
+
+		// motion gating: the last result is reused while the marker stays put (Run gates on the camera corners when rectified)
+		if (mhParams.staticMotion > 0.0f && mhParams.rectSize <= 0 && !prevFrame.IsEmpty())
+		{
+			const float motion = CalcCornerMotion(prevFrame.Corners(), corners);
+			if (motion <= mhParams.staticMotion)
+			{
+				Recomposite(color, inpainted, corners, motion, params.blurSize);
+				return;
+			}
+		}
+
+		// the nearest and the second nearest keyframes in view distance
+		int nearest = -1, second = -1;
+		float nearestDist = FLT_MAX, secondDist = FLT_MAX;
+		for (int idx = 0; idx < vKeyframes.size(); ++idx)
+		{
+			const float dist = CalcViewDist(rvec, tvec, vKeyframes[idx].rvec, vKeyframes[idx].tvec);
+			if (dist < nearestDist)
+			{
+				second = nearest;
+				secondDist = nearestDist;
+				nearest = idx;
+				nearestDist = dist;
+			}
+			else if (dist < secondDist)
+			{
+				second = idx;
+				secondDist = dist;
+			}
+		}
+		// no usable view distance (degenerate poses): the oldest keyframe, i.e. the one from Reset or the first loaded one
+		const bool hasDist = nearest >= 0;
+		if (!hasDist) nearest = 0;
+
+		// temporal warm start: the previous result warped by the frame-to-frame homography until it drifts
+		const bool hasPrev = mhParams.temporal && !prevFrame.IsEmpty() && corners.size() == prevFrame.Corners().size();
+		const bool drifted = hasPrev && prevMeanCost > kfMeanCost * mhParams.driftRatio;
+		const bool temporal = hasPrev && !drifted && numTemporal < mhParams.maxTemporalFrames;
+		if (drifted) std::cout << "[PixMixMarkerHiding::Run] Mean cost " << prevMeanCost << " drifted from " << kfMeanCost << "; restarting from a keyframe" << std::endl;
+		const bool blend = !temporal && mhParams.blendKeyframes && second >= 0;
+
+		cv::Mat newMkCorns, mask;
+		AddMarginToMarkerCorners(corners, newMkCorns);
+		dr::util::CreateMaskFromCorners(newMkCorns, color.size(), mask);
+
+		// only the ROI around the hole is warped
+		const cv::Rect roi = CalcRoi(newMkCorns, color.size());
+		cv::Mat refColor, refNNF, refCost, refColor2, refNNF2, refCost2;
+		if (temporal) prevFrame.GetWarped(corners, roi, refColor, refNNF, refCost);
+		else vKeyframes[nearest].kf.GetWarped(corners, roi, refColor, refNNF, refCost);
+		if (blend) vKeyframes[second].kf.GetWarped(corners, roi, refColor2, refNNF2, refCost2);
+
+		// fill in non-masked area with the original color
+		const det::Philox4x32 rng(params.seed);
+		const cv::Mat colorMat = color.getMat();
+		const auto inFrame = [&](const cv::Vec2s& p) { return p[0] >= 0 && p[0] < colorMat.rows && p[1] >= 0 && p[1] < colorMat.cols; };
+		double sumCost = 0.0;
+		int numCost = 0;
+		for (int r = 0; r < refColor.rows; ++r)
+		{
+			const int fr = roi.y + r;	// in the frame
+			auto refColorPtr = refColor.ptr<cv::Vec3b>(r);
+			auto colorPtr = colorMat.ptr<cv::Vec3b>(fr) + roi.x;
+			auto refNNFPtr = refNNF.ptr<cv::Vec2s>(r);
+			auto refCostPtr = refCost.ptr<ushort>(r);
+			auto maskPtr = mask.ptr<uchar>(fr) + roi.x;
+			for (int c = 0; c < refColor.cols; ++c)
+			{
+				const int fc = roi.x + c;
+				if (maskPtr[c] != 0)
+				{
+					refColorPtr[c] = colorPtr[c];
+					refNNFPtr[c] = cv::Vec2s(short(fr), short(fc));
+					continue;
+				}
+
+				// mean cost of the warped source over the hole pixels it covers
+				if (inFrame(refNNFPtr[c]) && refCostPtr[c] != det::costInvalid)
+				{
+					sumCost += det::DecodeCost(refCostPtr[c]);
+					++numCost;
+				}
+
+				// the second keyframe fills the pixels the nearest one does not cover (elsewhere its matches are candidates)
+				if (blend && !inFrame(refNNFPtr[c]) && inFrame(refNNF2.at<cv::Vec2s>(r, c)))
+				{
+					refColorPtr[c] = refColor2.at<cv::Vec3b>(r, c);
+					refNNFPtr[c] = refNNF2.at<cv::Vec2s>(r, c);
+				}
+
+				if (!inFrame(refNNFPtr[c]))
+				{
+					refNNFPtr[c][0] = short(det::Philox4x32::ToRange(rng(fr, fc, 0, 0), colorMat.rows));
+					refNNFPtr[c][1] = short(det::Philox4x32::ToRange(rng(fr, fc, 0, 1), colorMat.cols));
+				}
+			}
+		}
+
+		det::PixMixKeyframe ref;
+		ref.Set(refColor, mask(roi), refNNF, refCost, corners, roi);
+
+		const double meanCost = numCost > 0 ? sumCost / numCost : 0.0;
+		if (!temporal && mhParams.refreshCost > 0.0f && meanCost > mhParams.refreshCost && StartRefresh(color, corners, rvec, tvec, mhParams.refreshParams))
+		{
+			std::cout << "[PixMixMarkerHiding::Run] Mean keyframe cost " << meanCost << " started a refresh" << std::endl;
+		}
+
+		if (debugViz)
+		{
+			cv::imshow("debug - reference color", refColor);
+			cv::waitKey(1);
+		}
+
+		// PixMix inpaints the hole from the NNF before the sweeps, so the second keyframe takes part through its matches:
+		// each hole pixel keeps the one of the two whose patch costs less (refNNF2 is empty without blending)
+		cv::Mat nnf, cost;
+		pm.Run(color, mask, ref, inpainted, nnf, cost, params, refNNF2);
+		solved = true;
+
+		// the refined result becomes a keyframe once the view is far enough from all the stored ones
+		if (hasDist && nearestDist > mhParams.newKeyframeDist)
+		{
+			det::PixMixKeyframe kf;
+			kf.Set(inpainted.getMat()(roi), mask(roi), nnf, cost, corners, roi);
+			AddKeyframe(kf, rvec, tvec, false);
+
+			std::cout << "[PixMixMarkerHiding::Run] Added a keyframe (" << vKeyframes.size() << " stored)" << std::endl;
+		}
+
+		prevMeanCost = CalcMeanCost(cost, mask(roi));
+		if (mhParams.temporal || mhParams.staticMotion > 0.0f)
+		{
+			if (temporal) ++numTemporal;
+			else
+			{
+				numTemporal = 0;
+				kfMeanCost = prevMeanCost;
+			}
+			prevFrame.Set(inpainted.getMat()(roi), mask(roi), nnf, cost, corners, roi);
+		}
+	}
+
+	void PixMixMarkerHiding::SetRectSize(int rectSize)
+	{
+		if (rectSize == mhParams.rectSize) return;
+
+		// keyframes in camera coordinates cannot be used in the rectified space and vice versa
+		if ((rectSize > 0) != (mhParams.rectSize > 0)) ClearKeyframes();
+		mhParams.rectSize = rectSize;
+		rectResult.release();
+	}
+
+	bool PixMixMarkerHiding::SaveKeyframes(const std::string& baseName) const
+	{
+		for (int idx = 0; idx < vKeyframes.size(); ++idx)
+		{
+			const auto& pkf = vKeyframes[idx];
+			if (!pkf.kf.Save(baseName + std::to_string(idx) + ".pmkf", pkf.rvec, pkf.tvec)) return false;
+		}
+
+		std::cout << "[PixMixMarkerHiding::SaveKeyframes] Saved " << vKeyframes.size() << " keyframe(s) to " << baseName << "*.pmkf" << std::endl;
+		return true;
+	}
+
+	bool PixMixMarkerHiding::LoadKeyframes(const std::vector<std::string>& fileNames)
+	{
+		ClearKeyframes();
+
+		// all or nothing: a file that fails leaves the store empty
+		std::vector<PoseKeyframe> vLoaded(fileNames.size());
+		for (int idx = 0; idx < fileNames.size(); ++idx)
+		{
+			vLoaded[idx].fromReset = true;
+			if (!vLoaded[idx].kf.Load(fileNames[idx], vLoaded[idx].rvec, vLoaded[idx].tvec))
+			{
+				std::cerr << "[PixMixMarkerHiding::LoadKeyframes] Failed to load " << fileNames[idx] << "; no keyframe is kept" << std::endl;
+				return false;
+			}
+		}
+
+		// loaded keyframes are never evicted, so the store grows to hold them all
+		if (int(vLoaded.size()) > mhParams.maxKeyframes)
+		{
+			std::cout << "[PixMixMarkerHiding::LoadKeyframes] Raised maxKeyframes from " << mhParams.maxKeyframes << " to " << vLoaded.size() << " to keep every loaded keyframe" << std::endl;
+			mhParams.maxKeyframes = int(vLoaded.size());
+		}
+		vKeyframes = std::move(vLoaded);
+
+		std::cout << "[PixMixMarkerHiding::LoadKeyframes] Loaded " << vKeyframes.size() << " keyframe(s)" << std::endl;
+		return !vKeyframes.empty();
+	}
+
+	void PixMixMarkerHiding::ClearKeyframes()
+	{
+		// a refresh still running would replace the new keyframes with an older view
+		if (bgTh.joinable()) bgTh.join();
+		bgReady = false;
+
+		vKeyframes.clear();
+		prevFrame = det::PixMixKeyframe();
+		rectResult.release();
+	}
+
+	bool PixMixMarkerHiding::RequestRefresh(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params)
 	{
-		if (!kf.IsEmpty() && corners.size() == kf.Corners().size())
+		if (refreshing.load() || corners.total() == 0) return false;
+		if (mhParams.rectSize <= 0) return StartRefresh(color, corners, rvec, tvec, params);
+
+		cv::Mat rectColor;
+		std::vector<cv::Point2f> rectCorners;
+		Rectify(color, corners, rectColor, rectCorners);
+		return StartRefresh(rectColor, rectCorners, rvec, tvec, params);
+	}
+
+	bool PixMixMarkerHiding::StartRefresh(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params)
+	{
+		if (refreshing.load() || corners.total() == 0) return false;
+		if (bgTh.joinable()) bgTh.join();	// already finished
+
+		// the thread works on its own copies; the caller may reuse its buffers right away
+		cv::Mat bgColor;
+		std::vector<cv::Point2f> bgCorners;
+		color.copyTo(bgColor);
+		corners.copyTo(bgCorners);
+		refreshing.store(true);
+		bgTh = std::thread([=]
 		{
-			cv::Mat refColor, refNNF, refCost;
-			kf.GetWarped(corners, refColor, refNNF, refCost);
+			// both only affect this thread: the OpenMP sweeps and the ParallelRows passes of bgPm
+			// (OpenCV's own calls in it, e.g. cv::resize and cv::warpPerspective, still use its global pool)
+#ifdef _OPENMP
+			omp_set_num_threads(std::max(mhParams.refreshThreads, 1));
+#endif
+			util::SetParallelRowsThreads(std::max(mhParams.refreshThreads, 1));
+			PoseKeyframe pkf;
+			InpaintKeyframe(bgPm, bgColor, bgCorners, params, pkf.kf);
+			pkf.rvec = rvec;
+			pkf.tvec = tvec;
+			pkf.fromReset = false;
 
-			cv::Mat newMkCorns, mask;
-			AddMarginToMarkerCorners(corners, newMkCorns);
-			dr::util::CreateMaskFromCorners(newMkCorns, color.size(), mask);
+			bgMtx.lock();
+			bgKeyframe = pkf;
+			bgReady = true;
+			bgMtx.unlock();
+			refreshing.store(false);
+		});
 
-			// fill in non-masked area with the original color
-			std::random_device rnd;
-			auto mt = std::mt19937(rnd());
-			auto rRand = std::uniform_int_distribution<int>(0, refColor.rows - 1);
-			auto cRand = std::uniform_int_distribution<int>(0, refColor.cols - 1);
-			for (int r = 0; r < refColor.rows; ++r)
+		return true;
+	}
+
+	void PixMixMarkerHiding::SwapInRefreshed()
+	{
+		bgMtx.lock();
+		if (bgReady)
+		{
+			// the refreshed keyframe replaces the nearest stored one of the same view (keeping whether it may be evicted)
+			// and is added like a new keyframe otherwise; the other views stay
+			int nearest = -1;
+			float nearestDist = mhParams.newKeyframeDist;
+			for (int idx = 0; idx < vKeyframes.size(); ++idx)
 			{
-				auto refColorPtr = refColor.ptr<cv::Vec3b>(r);
-				auto colorPtr = color.getMat().ptr<cv::Vec3b>(r);
-				auto refNNFPtr = refNNF.ptr<cv::Vec2i>(r);
-				auto maskPtr = mask.ptr<uchar>(r);
-				for (int c = 0; c < refColor.cols; ++c)
+				const float dist = CalcViewDist(bgKeyframe.rvec, bgKeyframe.tvec, vKeyframes[idx].rvec, vKeyframes[idx].tvec);
+				if (dist <= nearestDist)
 				{
-					if (maskPtr[c] != 0)
-					{
-						refColorPtr[c] = colorPtr[c];
-						refNNFPtr[c] = cv::Vec2i(r, c);
-					}
-
-					if (refNNFPtr[c][0] < 0 || refNNFPtr[c][0] >= refColor.rows
-						|| refNNFPtr[c][1] < 0 || refNNFPtr[c][1] >= refColor.cols)
-					{
-						refNNFPtr[c][0] = rRand(mt);
-						refNNFPtr[c][1] = cRand(mt);
-					}
+					nearest = idx;
+					nearestDist = dist;
 				}
 			}
+			if (nearest >= 0)
+			{
+				bgKeyframe.fromReset = vKeyframes[nearest].fromReset;
+				vKeyframes[nearest] = bgKeyframe;
+			}
+			else AddKeyframe(bgKeyframe.kf, bgKeyframe.rvec, bgKeyframe.tvec, false);
+
+			bgKeyframe = PoseKeyframe();
+			prevFrame = det::PixMixKeyframe();
+			rectResult.release();
+			bgReady = false;
+			std::cout << "[PixMixMarkerHiding::SwapInRefreshed] Swapped in a refreshed keyframe (" << vKeyframes.size() << " stored)" << std::endl;
+		}
+		bgMtx.unlock();
+	}
+
+	void PixMixMarkerHiding::InpaintKeyframe(PixMix& pmKf, cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params, det::PixMixKeyframe& kf)
+	{
+		std::vector<cv::Point2f> newMkCors;
+		AddMarginToMarkerCorners(corners, newMkCors);
+
+		// PixMix
+		cv::Mat inpainted, nnf, cost, mask;
+		dr::util::CreateMaskFromCorners(newMkCors, color.size(), mask);
+		pmKf.Run(color, mask, inpainted, nnf, cost, params);
+		const cv::Rect roi = CalcRoi(newMkCors, color.size());
+		kf.Set(inpainted(roi), mask(roi), nnf(roi), cost(roi), corners, roi);
+	}
+
+	void PixMixMarkerHiding::AddKeyframe(const det::PixMixKeyframe& kf, const cv::Vec3d& rvec, const cv::Vec3d& tvec, bool fromReset)
+	{
+		if (int(vKeyframes.size()) >= std::max(mhParams.maxKeyframes, 1))
+		{
+			// evict the oldest keyframe not from Reset
+			auto it = std::find_if(vKeyframes.begin(), vKeyframes.end(), [](const PoseKeyframe& pkf) { return !pkf.fromReset; });
+			if (it == vKeyframes.end()) return;
+			vKeyframes.erase(it);
+		}
 
-			det::PixMixKeyframe ref;
-			ref.Set(refColor, mask, refNNF, refCost, corners);
+		vKeyframes.push_back({ kf, rvec, tvec, fromReset });
+	}
+
+	double PixMixMarkerHiding::CalcMeanCost(cv::InputArray cost, cv::InputArray mask)
+	{
+		const cv::Mat1w costMat = cost.getMat();
+		const cv::Mat1b maskMat = mask.getMat();
+		assert(costMat.size() == maskMat.size());
 
-			if (debugViz)
+		double sum = 0.0;
+		int num = 0;
+		for (int r = 0; r < costMat.rows; ++r)
+		{
+			auto costPtr = costMat.ptr<ushort>(r);
+			auto maskPtr = maskMat.ptr<uchar>(r);
+			for (int c = 0; c < costMat.cols; ++c)
 			{
-				cv::imshow("debug - reference color", refColor);
-				cv::waitKey(1);
+				if (maskPtr[c] != 0 || costPtr[c] == det::costInvalid) continue;
+				sum += det::DecodeCost(costPtr[c]);
+				++num;
 			}
+		}
+
+		return num > 0 ? sum / num : 0.0;
+	}
+
+	float PixMixMarkerHiding::CalcCornerMotion(cv::InputArray corners1, cv::InputArray corners2)
+	{
+		std::vector<cv::Point2f> pts1, pts2;
+		corners1.copyTo(pts1);
+		corners2.copyTo(pts2);
+		assert(pts1.size() == pts2.size());
+
+		float motion = 0.0f;
+		for (int idx = 0; idx < pts1.size(); ++idx)
+		{
+			const cv::Point2f d = pts1[idx] - pts2[idx];
+			motion = std::max(motion, std::sqrt(d.x * d.x + d.y * d.y));
+		}
+
+		return motion;
+	}
 
-			pm.Run(color, mask, ref, inpainted, params);
+	void PixMixMarkerHiding::Recomposite(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, float motion, int blurSize)
+	{
+		// identical corners: the same ROI and mask, nothing to warp
+		if (motion == 0.0f)
+		{
+			color.copyTo(inpainted);
+			cv::Mat dst = inpainted.getMat();
+			const cv::Rect& roi = prevFrame.Roi();
+			util::BlendBorder(color.getMat()(roi), prevFrame.Mask(), prevFrame.Color(), blurSize, dst(roi));
+			return;
 		}
+
+		// warp of the cached result only (the solver is skipped)
+		const cv::Rect& srcRoi = prevFrame.Roi();
+		const cv::Matx33d H = cv::findHomography(prevFrame.Corners(), corners);
+		CompositeWarped(color, inpainted, corners, prevFrame.Color(), H * cv::Matx33d(1.0, 0.0, srcRoi.x, 0.0, 1.0, srcRoi.y, 0.0, 0.0, 1.0), blurSize);
+	}
+
+	void PixMixMarkerHiding::CompositeWarped(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, cv::InputArray src, const cv::Matx33d& H, int blurSize)
+	{
+		cv::Mat newMkCorns, mask;
+		AddMarginToMarkerCorners(corners, newMkCorns);
+		dr::util::CreateMaskFromCorners(newMkCorns, color.size(), mask);
+		const cv::Rect roi = CalcRoi(newMkCorns, color.size());
+
+		const cv::Matx33d Hroi = cv::Matx33d(1.0, 0.0, -roi.x, 0.0, 1.0, -roi.y, 0.0, 0.0, 1.0) * H;
+		cv::Mat warped;
+		cv::warpPerspective(src, warped, Hroi, roi.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+		color.copyTo(inpainted);
+		cv::Mat dst = inpainted.getMat();
+		util::BlendBorder(color.getMat()(roi), mask(roi), warped, blurSize, dst(roi));
+	}
+
+	void PixMixMarkerHiding::CalcRectCorners(std::vector<cv::Point2f>& rectCorners) const
+	{
+		// the marker in the middle of rectSize x rectSize covering its margin and rectVicinity on each side
+		const float side = markerSize + 2.0f * markerMargin + 2.0f * mhParams.rectVicinity * markerSize;
+		const float scale = mhParams.rectSize / side;
+		const float o = 0.5f * (mhParams.rectSize - markerSize * scale), e = o + markerSize * scale;
+
+		// same order as the marker corners of AddMarginToMarkerCorners
+		rectCorners = { cv::Point2f(e, o), cv::Point2f(e, e), cv::Point2f(o, e), cv::Point2f(o, o) };
+	}
+
+	void PixMixMarkerHiding::Rectify(cv::InputArray color, cv::InputArray corners, cv::OutputArray rectColor, std::vector<cv::Point2f>& rectCorners) const
+	{
+		CalcRectCorners(rectCorners);
+		const cv::Matx33d H = cv::findHomography(corners, rectCorners);
+		cv::warpPerspective(color, rectColor, H, cv::Size(mhParams.rectSize, mhParams.rectSize), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+	}
+
+	float PixMixMarkerHiding::CalcViewDist(const cv::Vec3d& rvec1, const cv::Vec3d& tvec1, const cv::Vec3d& rvec2, const cv::Vec3d& tvec2)
+	{
+		// camera centers in the marker coordinate system: -R^T t
+		const auto calcCenter = [](const cv::Vec3d& rvec, const cv::Vec3d& tvec)
+		{
+			cv::Matx33d R;
+			cv::Rodrigues(rvec, R);
+			return cv::Vec3d(R.t() * (-tvec));
+		};
+		const cv::Vec3d c1 = calcCenter(rvec1, tvec1);
+		const cv::Vec3d c2 = calcCenter(rvec2, tvec2);
+		const double n1 = cv::norm(c1), n2 = cv::norm(c2);
+		if (!(n1 > 0.0 && n2 > 0.0)) return FLT_MAX;	// also NaN
+
+		const double cosAngle = std::min(std::max(c1.dot(c2) / (n1 * n2), -1.0), 1.0);
+		const double dist = std::acos(cosAngle) + std::abs(std::log(n1 / n2));
+		return std::isfinite(dist) ? float(dist) : FLT_MAX;	// e.g. a NaN pose
 	}
 
 	void PixMixMarkerHiding::AddMarginToMarkerCorners(cv::InputArray corners, cv::OutputArray newCorners)
@@ -103,4 +518,17 @@ namespace dr
 		cv::Mat res(corners.size(), corners.type(), &newMkCors.front());
 		res.copyTo(newCorners);
 	}
+
+	cv::Rect PixMixMarkerHiding::CalcRoi(cv::InputArray newCorners, const cv::Size& size)
+	{
+		// bounding box of the corners with margin, plus a few pixels for the bilinear warp of the keyframe color
+		const int padding = 2;
+		cv::Rect roi = cv::boundingRect(newCorners);
+		roi.x -= padding;
+		roi.y -= padding;
+		roi.width += 2 * padding;
+		roi.height += 2 * padding;
+
+		return roi & cv::Rect(cv::Point(0, 0), size);
+	}
 }
\ No newline at end of file
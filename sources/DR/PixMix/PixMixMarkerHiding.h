@@ -1,28 +1,117 @@
 #pragma once
 
+#include <thread>
+#include <mutex>
 #include "PixMix.h"
 #include "ArUcoMarker/ArUcoMarker.h"
 #include "Utilities.h"
 
 namespace dr
 {
+	namespace det
+	{
+		struct PixMixMarkerHidingParams
+		{
+			int maxKeyframes = 8;			// size of the keyframe store (the keyframe from Reset is never evicted)
+			float newKeyframeDist = 0.35f;	// view distance to the nearest keyframe above which the result becomes a keyframe
+			bool blendKeyframes = false;	// also offer the matches of the second nearest keyframe; each hole pixel keeps the cheaper one
+			float refreshCost = 0.0f;		// mean warped keyframe cost in the hole above which Run starts a background refresh (0: off)
+			int refreshThreads = 1;			// threads of the OpenMP sweeps and ParallelRows passes of the background refresh
+			PixMixParams refreshParams;		// parameters of the refreshes started by Run
+			bool temporal = false;			// start Run from the previous result warped to the current frame instead of a keyframe
+			float driftRatio = 1.5f;		// back to the keyframe once the mean refined cost exceeds this ratio of the one right after the last keyframe start
+			int maxTemporalFrames = 60;		// back to the keyframe after this many temporal frames in a row
+			float staticMotion = 0.0f;		// max corner motion in pixels since the last refined frame below which its result is re-composited (0: off)
+			int rectSize = 0;				// side in pixels of the rectified marker-centred image the solver runs on (0: the camera image)
+			float rectVicinity = 1.0f;		// surroundings in the rectified image on each side of the margin, relative to the marker size
+		};
+	}
+
 	class PixMixMarkerHiding
 	{
 	public:
-		PixMixMarkerHiding(const ArUcoMarker& marker, bool debugViz = false);
+		PixMixMarkerHiding(const ArUcoMarker& marker, bool debugViz = false, const det::PixMixMarkerHidingParams& mhParams = det::PixMixMarkerHidingParams());
 		~PixMixMarkerHiding();
 
-		void Reset(cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params);
-		void Run(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const det::PixMixParams& params);
-		inline bool const IsInitiated() const { return !kf.IsEmpty(); }
+		// rvec and tvec: marker pose (ArUcoMarker::GetPose) used to index the keyframes
+		void Reset(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params);
+		void Run(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params);
+		inline bool const IsInitiated() const { return !vKeyframes.empty(); }
+		inline int const NumKeyframes() const { return int(vKeyframes.size()); }
+
+		// keyframe files <baseName><index>.pmkf (PixMixKeyframe::Save) with the pose of each keyframe
+		bool SaveKeyframes(const std::string& baseName) const;
+		// replaces the keyframes with the given files, which are never evicted like the one from Reset
+		// (maxKeyframes grows to hold them all); on any failure no keyframe is kept
+		bool LoadKeyframes(const std::vector<std::string>& fileNames);
+
+		// Inpaints a keyframe of the given view on a background thread while Run keeps using the stored keyframes.
+		// The next Run after it finishes swaps it in for the stored keyframe of the same view (or adds it). false when a refresh is already running.
+		bool RequestRefresh(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params);
+		inline bool IsRefreshing() const { return refreshing.load(); }
+
+		// The stored keyframes are warped to the new rectified size, so it can change between frames
+		// (PixMixScheduler); switching between the camera image and the rectified space needs a new Reset.
+		void SetRectSize(int rectSize);
+		inline int RectSize() const { return mhParams.rectSize; }
+		// the last Run (or Reset) ran the solver (not gated), with pm's timings and the mean refined cost in the hole
+		inline bool Solved() const { return solved; }
+		inline const PixMix& GetPixMix() const { return pm; }
+		inline double LastMeanCost() const { return prevMeanCost; }
 
 	private:
 		PixMix pm;
-		det::PixMixKeyframe kf;
+
+		struct PoseKeyframe
+		{
+			det::PixMixKeyframe kf;
+			cv::Vec3d rvec, tvec;
+			bool fromReset;
+		};
+		std::vector<PoseKeyframe> vKeyframes;	// in insertion order
+		det::PixMixMarkerHidingParams mhParams;
 
 		float markerSize, markerMargin;
 		bool debugViz;
 
+		void ClearKeyframes();
+		void RunInpaint(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params);
+		void InpaintKeyframe(PixMix& pmKf, cv::InputArray color, cv::InputArray corners, const det::PixMixParams& params, det::PixMixKeyframe& kf);
 		void AddMarginToMarkerCorners(cv::InputArray corners, cv::OutputArray newCorners);
+		cv::Rect CalcRoi(cv::InputArray newCorners, const cv::Size& size);	// keyframe region around the masked marker
+		void AddKeyframe(const det::PixMixKeyframe& kf, const cv::Vec3d& rvec, const cv::Vec3d& tvec, bool fromReset);
+		// angle between the viewing directions of the marker plus the log ratio of the viewing distances
+		static float CalcViewDist(const cv::Vec3d& rvec1, const cv::Vec3d& tvec1, const cv::Vec3d& rvec2, const cv::Vec3d& tvec2);
+		static double CalcMeanCost(cv::InputArray cost, cv::InputArray mask);	// over the evaluated hole pixels
+		static float CalcCornerMotion(cv::InputArray corners1, cv::InputArray corners2);	// max displacement in pixels
+		// re-composites prevFrame onto color without running PixMix (no warp when the corners did not move)
+		void Recomposite(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, float motion, int blurSize);
+		// warps src by H (from src to the camera image) and blends it into the hole of corners
+		void CompositeWarped(cv::InputArray color, cv::OutputArray inpainted, cv::InputArray corners, cv::InputArray src, const cv::Matx33d& H, int blurSize);
+
+		// rectified marker space (rectSize > 0)
+		cv::Mat rectResult;					// the last refined result in the rectified image
+		cv::Mat rectResultCorners;			// camera corners of rectResult
+		void CalcRectCorners(std::vector<cv::Point2f>& rectCorners) const;
+		void Rectify(cv::InputArray color, cv::InputArray corners, cv::OutputArray rectColor, std::vector<cv::Point2f>& rectCorners) const;
+
+		// temporal warm start and motion gating
+		det::PixMixKeyframe prevFrame;	// the last refined result as a keyframe
+		int numTemporal = 0;			// temporal frames since the last keyframe start
+		double prevMeanCost = 0.0, kfMeanCost = 0.0;	// mean refined cost of the last frame and of the last keyframe start
+		bool solved = false;
+
+#pragma region BACKGROUND REFRESH
+		PixMix bgPm;	// own pyramid so that pm stays with the frame loop
+		std::thread bgTh;
+		std::atomic<bool> refreshing;
+		std::mutex bgMtx;
+		PoseKeyframe bgKeyframe;	// guarded by bgMtx
+		bool bgReady = false;		// guarded by bgMtx
+
+		// RequestRefresh on color and corners of the space the solver runs in (already rectified when rectSize > 0)
+		bool StartRefresh(cv::InputArray color, cv::InputArray corners, const cv::Vec3d& rvec, const cv::Vec3d& tvec, const det::PixMixParams& params);
+		void SwapInRefreshed();
+#pragma endregion
 	};
 }
\ No newline at end of file
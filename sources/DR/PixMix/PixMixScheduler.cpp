@@ -0,0 +1,194 @@
+#include "PixMixScheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace dr
+{
+	namespace det
+	{
+		std::ostream& operator<<(std::ostream& os, const PixMixDecision& decision)
+		{
+			return os << "frame " << decision.frame << ": " << decision.knob << " " << decision.from << " -> " << decision.to
+				<< " (" << decision.reason << "; frame " << decision.frameMs << " ms, solver " << decision.solverMs
+				<< " ms, mean cost " << decision.meanCost << ")";
+		}
+	}
+
+	PixMixScheduler::PixMixScheduler(const det::PixMixBudget& budget, const det::PixMixParams& initParams, int initRectSize)
+		: budget(budget), params(initParams), rectSize(initRectSize)
+	{
+	}
+
+	bool PixMixScheduler::Update(double frameMs, const std::vector<double>& vLvMs, const std::vector<int>& vUsedItrs, double meanCost)
+	{
+		++frame;
+		++sinceChange;
+
+		double solverMs = 0.0;
+		for (auto ms : vLvMs) solverMs += ms;
+		numLvs = int(vLvMs.size());
+		coarsestMs = vLvMs.empty() ? 0.0 : vLvMs.back();
+
+		// running averages restart at every change so that they only reflect the current knobs
+		const double a = sinceChange == 1 ? 1.0 : budget.smoothing;
+		frameAvg = a * frameMs + (1.0 - a) * frameAvg;
+		solverAvg = a * solverMs + (1.0 - a) * solverAvg;
+		costAvg = a * meanCost + (1.0 - a) * costAvg;
+		if (!vUsedItrs.empty() && vUsedItrs[0] > 0)
+		{
+			const double itrMs = vLvMs[0] / vUsedItrs[0];	// one iteration of the finest level
+			itrMsAvg = itrMsAvg > 0.0 && sinceChange > 1 ? budget.smoothing * itrMs + (1.0 - budget.smoothing) * itrMsAvg : itrMs;
+		}
+
+		// over the target: the latest raise is undone first; once all are, the knobs go down in reverse order
+		if (sinceChange >= budget.downFrames && frameAvg > budget.targetMs)
+		{
+			int knob = -1, to = 0;
+			while (knob < 0 && !vRaises.empty())
+			{
+				const Raise raise = vRaises.back();
+				vRaises.pop_back();
+				if (Tunable(raise.knob) && raise.from < Value(raise.knob))
+				{
+					knob = raise.knob;
+					to = raise.from;
+				}
+			}
+			for (int k = NUM_KNOBS - 1; k >= 0 && knob < 0; --k)
+			{
+				if (!Tunable(k) || Lower(k) >= Value(k)) continue;
+				knob = k;
+				to = Lower(k);
+			}
+			if (knob < 0) return false;
+
+			std::fill(blocked, blocked + NUM_KNOBS, false);
+			trialKnob = -1;
+			Change(knob, to, "over budget");
+			return true;
+		}
+		if (sinceChange < budget.settleFrames) return false;
+
+		// an increase in iterations or samples that did not lower the cost is undone
+		if (trialKnob >= 0)
+		{
+			const int knob = trialKnob;
+			trialKnob = -1;
+			if (costAvg > trialCost * (1.0 - budget.minCostGain))
+			{
+				// the trial is the latest raise (an over-budget change in between ends the trial)
+				assert(!vRaises.empty() && vRaises.back().knob == knob);
+				const int from = vRaises.back().from;
+				vRaises.pop_back();
+				blocked[knob] = true;
+				Change(knob, from, "no cost gain");
+				return true;
+			}
+		}
+
+		// below the target: the first knob whose predicted extra time fits goes up
+		const bool settled = budget.settledCost > 0.0f && costAvg <= budget.settledCost;
+		const double slack = budget.targetMs * budget.headroom - frameAvg;
+		for (int knob = 0; knob < NUM_KNOBS; ++knob)
+		{
+			const bool refinement = knob == MAX_ITR || knob == MAX_RAND_SEARCH_ITR;
+			if (!Tunable(knob) || blocked[knob] || (settled && refinement)) continue;
+			const int to = Higher(knob);
+			if (to <= Value(knob) || ExtraMs(knob, to) > slack) continue;
+
+			if (refinement)
+			{
+				trialKnob = knob;
+				trialCost = costAvg;
+			}
+			vRaises.push_back({ knob, Value(knob) });
+			Change(knob, to, "within budget");
+			return true;
+		}
+
+		return false;
+	}
+
+	int& PixMixScheduler::Value(int knob)
+	{
+		switch (knob)
+		{
+		case MAX_PYRM_LV: return params.maxPyrmLv;
+		case RECT_SIZE: return rectSize;
+		case MAX_ITR: return params.maxItr;
+		default: return params.maxRandSearchItr;
+		}
+	}
+
+	bool PixMixScheduler::Tunable(int knob) const
+	{
+		// the pyramid only matters when the reported frames run one (e.g. not the keyframe Run of PixMixMarkerHiding)
+		if (knob == MAX_PYRM_LV) return numLvs > 1;
+		if (knob == RECT_SIZE) return rectSize > 0 && budget.maxRectSize > 0;
+		return true;
+	}
+
+	int PixMixScheduler::Lower(int knob)
+	{
+		const int v = Value(knob);
+		switch (knob)
+		{
+		case MAX_PYRM_LV: return std::max(v - 1, 1);
+		case RECT_SIZE: return std::max(int(v * 0.8) / 8 * 8, budget.minRectSize);
+		case MAX_ITR: return std::max(v - 1, 1);
+		// 0 and 1 both draw one sample (OneLvPixMix::RandomSearch), so 1 does not go lower and 2 goes to 0
+		default: return v > 2 ? v / 2 : (v == 2 ? 0 : v);
+		}
+	}
+
+	int PixMixScheduler::Higher(int knob)
+	{
+		const int v = Value(knob);
+		switch (knob)
+		{
+		// no deeper pyramid when the frame size already limits it (PixMix::CalcPyrmLv)
+		case MAX_PYRM_LV: return numLvs < v ? v : std::min(v + 1, budget.maxPyrmLv);
+		case RECT_SIZE: return std::min((int(v * 1.25) + 7) / 8 * 8, budget.maxRectSize);
+		case MAX_ITR: return std::min(v + 1, budget.maxItr);
+		// 0 and 1 both draw one sample, so the first step that adds one is to 2
+		default:
+		{
+			const int to = std::min(std::max(2 * v, 2), budget.maxRandSearchItr);
+			return to > 1 ? to : v;
+		}
+		}
+	}
+
+	double PixMixScheduler::ExtraMs(int knob, int to)
+	{
+		const int v = Value(knob);
+		switch (knob)
+		{
+		// a new coarsest level has a quarter of the pixels of the current one
+		case MAX_PYRM_LV: return 0.25 * coarsestMs;
+		// the solver time grows with the pixel count
+		case RECT_SIZE: return solverAvg * (double(to) * to / (double(v) * v) - 1.0);
+		case MAX_ITR: return itrMsAvg * (to - v);
+		// a pixel evaluates about four propagation candidates plus the random samples (at least one) per iteration
+		default: return itrMsAvg * params.maxItr * (to - std::max(v, 1)) / (4.0 + std::max(v, 1));
+		}
+	}
+
+	void PixMixScheduler::Change(int knob, int to, const char* reason)
+	{
+		static const char* names[NUM_KNOBS] = { "maxPyrmLv", "rectSize", "maxItr", "maxRandSearchItr" };
+
+		decision.frame = frame;
+		decision.knob = names[knob];
+		decision.from = Value(knob);
+		decision.to = to;
+		decision.frameMs = frameAvg;
+		decision.solverMs = solverAvg;
+		decision.meanCost = costAvg;
+		decision.reason = reason;
+
+		Value(knob) = to;
+		sinceChange = 0;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include "OneLvPixMix.h"
+
+namespace dr
+{
+	namespace det
+	{
+		struct PixMixBudget
+		{
+			double targetMs = 33.0;		// per-frame latency to stay within
+			float headroom = 0.85f;		// a knob goes up only when the predicted frame time stays below this ratio of targetMs
+			float smoothing = 0.3f;		// weight of the newest frame in the running averages
+			int downFrames = 3;			// frames over the target (since the last change) before a knob goes down
+			int settleFrames = 15;		// frames since the last change before a knob goes up
+			float settledCost = 0.0f;	// mean refined cost below which no more iterations or samples are spent (0: off)
+			float minCostGain = 0.02f;	// an iteration or sample increase that lowers the mean cost by less than this ratio is undone
+			int maxItr = 4;				// upper limits of the knobs
+			int maxRandSearchItr = 8;
+			int maxPyrmLv = 5;
+			int minRectSize = 128;		// limits of the rectified resolution (PixMixMarkerHidingParams::rectSize; not tuned when it is 0)
+			int maxRectSize = 512;
+		};
+
+		// one change of a knob, for logging
+		struct PixMixDecision
+		{
+			long long frame = 0;
+			const char* knob = "";		// "maxPyrmLv", "rectSize", "maxItr" or "maxRandSearchItr"
+			int from = 0, to = 0;
+			double frameMs = 0.0, solverMs = 0.0, meanCost = 0.0;	// averages that led to the decision
+			const char* reason = "";
+		};
+		std::ostream& operator<<(std::ostream& os, const PixMixDecision& decision);
+	}
+
+	// Tunes maxItr, maxRandSearchItr, maxPyrmLv and the rectified resolution online to the best quality that still
+	// fits a per-frame latency. Report every frame that ran the solver; apply Params() and RectSize() to the next one.
+	class PixMixScheduler
+	{
+	public:
+		PixMixScheduler(const det::PixMixBudget& budget, const det::PixMixParams& initParams, int initRectSize = 0);
+
+		// frameMs: whole latency of the frame; vLvMs and vUsedItrs: PixMix::GetLvTimes and GetUsedItrs; meanCost: mean refined cost in the hole.
+		// true when a knob changed (LastDecision)
+		bool Update(double frameMs, const std::vector<double>& vLvMs, const std::vector<int>& vUsedItrs, double meanCost);
+
+		inline const det::PixMixParams& Params() const { return params; }
+		inline int RectSize() const { return rectSize; }
+		inline const det::PixMixDecision& LastDecision() const { return decision; }
+
+	private:
+		// in the order they go up; over the target the raises are undone last first,
+		// then knobs that started above their lower limit go down in reverse order
+		enum Knob { MAX_PYRM_LV = 0, RECT_SIZE, MAX_ITR, MAX_RAND_SEARCH_ITR, NUM_KNOBS };
+		struct Raise { int knob, from; };
+
+		const det::PixMixBudget budget;
+		det::PixMixParams params;
+		int rectSize;
+		det::PixMixDecision decision;
+
+		long long frame = 0;
+		int sinceChange = 0;		// frames reported since the last change
+		double frameAvg = 0.0, solverAvg = 0.0, costAvg = 0.0, itrMsAvg = 0.0;	// since the last change
+		double coarsestMs = 0.0;	// of the coarsest level
+		int numLvs = 0;
+		int trialKnob = -1;			// iteration or sample increase whose cost gain is still to be checked
+		double trialCost = 0.0;		// costAvg before it
+		bool blocked[NUM_KNOBS] = {};	// increases that did not pay off, until the next decrease
+		std::vector<Raise> vRaises;		// increases not undone yet, the latest last
+
+		int& Value(int knob);
+		bool Tunable(int knob) const;
+		int Lower(int knob);
+		int Higher(int knob);
+		double ExtraMs(int knob, int to);	// predicted extra frame time of the increase
+		void Change(int knob, int to, const char* reason);
+	};
+}
\ No newline at end of file
@@ -1,9 +1,26 @@
 #include "DR/PixMix/Utilities.h"
 
+#include <opencv2/core/hal/intrin.hpp>
+
 namespace dr
 {
 	namespace util
 	{
+		namespace
+		{
+			thread_local int parallelRowsThreads = 0;
+		}
+
+		void SetParallelRowsThreads(int numThreads)
+		{
+			parallelRowsThreads = numThreads;
+		}
+
+		int GetParallelRowsThreads()
+		{
+			return parallelRowsThreads;
+		}
+
 		void CreateMaskFromCorners(cv::InputArray corners, const cv::Size& size, cv::OutputArray mask)
 		{
 			cv::Mat convexCorners = corners.getMat().clone();
@@ -19,14 +36,102 @@ namespace dr
 			auto src = cv::Mat2i(srcPosMap.getMat());
 			auto dst = cv::Mat3b(srcPosMap.size());
 
-			for (int r = 0; r < src.rows; ++r) for (int c = 0; c < src.cols; ++c)
+			ParallelRows(src.rows, src.cols, [&](int rBegin, int rEnd)
 			{
-				dst(r, c)[0] = int((float)src(r, c)[1] / (float)src.cols * 255.0f);
-				dst(r, c)[1] = int((float)src(r, c)[0] / (float)src.rows * 255.0f);
-				dst(r, c)[2] = 255;
-			}
+				for (int r = rBegin; r < rEnd; ++r)
+				{
+					auto ptrSrc = src.ptr<cv::Vec2i>(r);
+					auto ptrDst = dst.ptr<cv::Vec3b>(r);
+					for (int c = 0; c < src.cols; ++c)
+					{
+						ptrDst[c][0] = int((float)ptrSrc[c][1] / (float)src.cols * 255.0f);
+						ptrDst[c][1] = int((float)ptrSrc[c][0] / (float)src.rows * 255.0f);
+						ptrDst[c][2] = 255;
+					}
+				}
+			});
 
 			dst.copyTo(dstColorMap);
 		}
+
+		void FillReflectBorder(cv::Mat& img, int top, int bottom, int left, int right)
+		{
+			const int w = img.cols - left - right;
+			const int h = img.rows - top - bottom;
+			// borderInterpolate keeps reflecting when a border is wider than the image (coarse pyramid levels)
+			for (int k = 1; k <= top; ++k) img.row(top + cv::borderInterpolate(-k, h, cv::BORDER_REFLECT)).copyTo(img.row(top - k));
+			for (int k = 1; k <= bottom; ++k) img.row(top + cv::borderInterpolate(h - 1 + k, h, cv::BORDER_REFLECT)).copyTo(img.row(top + h - 1 + k));
+			for (int k = 1; k <= left; ++k) img.col(left + cv::borderInterpolate(-k, w, cv::BORDER_REFLECT)).copyTo(img.col(left - k));
+			for (int k = 1; k <= right; ++k) img.col(left + cv::borderInterpolate(w - 1 + k, w, cv::BORDER_REFLECT)).copyTo(img.col(left + w - 1 + k));
+		}
+
+		cv::Rect CalcBlendRoi(cv::InputArray mask, int blurSize)
+		{
+			// scans (and allocates) a whole mask; callers that know the hole box pass it instead
+			const cv::Mat maskMat = mask.getMat();
+			return CalcBlendRoi(cv::boundingRect(maskMat != 255), maskMat.size(), blurSize);
+		}
+
+		cv::Rect CalcBlendRoi(const cv::Rect& hole, const cv::Size& size, int blurSize)
+		{
+			if (hole.empty()) return cv::Rect();
+
+			const int reach = blurSize / 2;
+			const cv::Rect roi(hole.x - reach, hole.y - reach, hole.width + 2 * reach, hole.height + 2 * reach);
+			return roi & cv::Rect(cv::Point(0, 0), size);
+		}
+
+		void BlendBorder(cv::InputArray color, cv::InputArray mask, cv::InputArray fill, int blurSize, cv::OutputArray dst, const cv::Rect& hole)
+		{
+			assert(color.size() == mask.size() && color.size() == fill.size());
+			assert(color.type() == CV_8UC3 && fill.type() == CV_8UC3 && mask.type() == CV_8U);
+
+			color.copyTo(dst);
+			const cv::Rect roi = hole.empty() ? CalcBlendRoi(mask, blurSize) : CalcBlendRoi(hole, mask.size(), blurSize);
+			if (roi.empty()) return;
+
+			// the box filter on the ROI view still reads the mask around it, i.e. same alpha as a full-frame blur
+			cv::Mat1b alpha;
+			cv::Mat3b alpha3;
+			cv::blur(mask.getMat()(roi), alpha, cv::Size(blurSize, blurSize));
+			cv::cvtColor(alpha, alpha3, cv::COLOR_GRAY2BGR);
+
+			const cv::Mat srcMat = color.getMat(), fillMat = fill.getMat();
+			cv::Mat dstMat = dst.getMat();
+			const int n = roi.width * 3;
+			ParallelRows(roi.height, roi.width, [&](int rBegin, int rEnd)
+			{
+				for (int r = rBegin; r < rEnd; ++r)
+				{
+					const uchar* ptrAlpha = alpha3.ptr<uchar>(r);
+					const uchar* ptrSrc = srcMat.ptr<uchar>(roi.y + r) + 3 * roi.x;
+					const uchar* ptrFill = fillMat.ptr<uchar>(roi.y + r) + 3 * roi.x;
+					uchar* ptrDst = dstMat.ptr<uchar>(roi.y + r) + 3 * roi.x;
+
+					// (a * s + (255 - a) * f) / 255 rounded, as ((v + 128) + ((v + 128) >> 8)) >> 8
+					int i = 0;
+#if CV_SIMD128
+					const cv::v_uint16x8 v128 = cv::v_setall_u16(128), v255 = cv::v_setall_u16(255);
+					for (; i <= n - 16; i += 16)
+					{
+						cv::v_uint16x8 aLo, aHi, sLo, sHi, fLo, fHi;
+						cv::v_expand(cv::v_load(ptrAlpha + i), aLo, aHi);
+						cv::v_expand(cv::v_load(ptrSrc + i), sLo, sHi);
+						cv::v_expand(cv::v_load(ptrFill + i), fLo, fHi);
+						cv::v_uint16x8 lo = cv::v_mul_wrap(aLo, sLo) + cv::v_mul_wrap(v255 - aLo, fLo) + v128;
+						cv::v_uint16x8 hi = cv::v_mul_wrap(aHi, sHi) + cv::v_mul_wrap(v255 - aHi, fHi) + v128;
+						lo = (lo + (lo >> 8)) >> 8;
+						hi = (hi + (hi >> 8)) >> 8;
+						cv::v_store(ptrDst + i, cv::v_pack(lo, hi));
+					}
+#endif
+					for (; i < n; ++i)
+					{
+						const int v = ptrAlpha[i] * ptrSrc[i] + (255 - ptrAlpha[i]) * ptrFill[i] + 128;
+						ptrDst[i] = uchar((v + (v >> 8)) >> 8);
+					}
+				}
+			});
+		}
 	}
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
 
 namespace dr
@@ -8,5 +10,71 @@ namespace dr
 	{
 		void CreateMaskFromCorners(cv::InputArray corners, const cv::Size& size, cv::OutputArray mask);
 		void CreateVizPosMap(cv::InputArray srcPosMap, cv::OutputArray dstColorMap);
+		// in-place cv::BORDER_REFLECT for an image whose interior is already filled in
+		void FillReflectBorder(cv::Mat& img, int top, int bottom, int left, int right);
+
+		// bounding box of the pixels with mask != 255 (hole when already known), grown by the reach of a blurSize box filter
+		cv::Rect CalcBlendRoi(cv::InputArray mask, int blurSize);
+		cv::Rect CalcBlendRoi(const cv::Rect& hole, const cv::Size& size, int blurSize);
+		// dst = a * color + (1 - a) * fill with a = blurred mask / 255, in 8-bit fixed point and only inside CalcBlendRoi;
+		// the rest of dst is a copy of color (nothing is copied when dst is color).
+		// hole: the bounding box of the mask != 255 pixels if the caller has it (empty: found by scanning mask)
+		void BlendBorder(cv::InputArray color, cv::InputArray mask, cv::InputArray fill, int blurSize, cv::OutputArray dst, const cv::Rect& hole = cv::Rect());
+
+		const int parallelGrain = 1 << 15;	// minimum number of pixels per stripe of ParallelRows
+
+		// Caps the stripes, hence the threads, of the ParallelRows passes started from the calling thread (0: no cap).
+		// cv::setNumThreads is process-wide, so a background thread uses this to leave the other cores to the frame loop.
+		void SetParallelRowsThreads(int numThreads);
+		int GetParallelRowsThreads();
+
+		// Runs body(rowBegin, rowEnd) over the rows [0, rows) of a pass touching cols pixels per row.
+		// The rows are split into stripes of at least grain pixels on cv::parallel_for_;
+		// a pass too small for two stripes runs on the calling thread.
+		template <typename Body>
+		void ParallelRows(int rows, int cols, const Body& body, int grain = parallelGrain)
+		{
+			double numStripes = std::min(double(rows), double(rows) * double(cols) / double(grain));
+			const int maxThreads = GetParallelRowsThreads();
+			if (maxThreads > 0) numStripes = std::min(numStripes, double(maxThreads));
+			if (numStripes < 2.0)
+			{
+				if (rows > 0) body(0, rows);
+				return;
+			}
+
+			cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) { body(range.start, range.end); }, numStripes);
+		}
+
+		// Lock-free exchange of the latest frame between one writer and one reader thread.
+		// The writer fills Back() and publishes it; the reader fetches the newest published frame.
+		// Neither side ever waits, and the three slots are reused, so there is no allocation once the size is stable.
+		class TripleBuffer
+		{
+		public:
+			TripleBuffer() : state(1), back(0), front(2), generation(0) { }
+
+			inline cv::Mat& Back() { return slots[back]; }
+			inline void Publish()
+			{
+				back = state.exchange(back | FRESH) & INDEX;
+				generation.fetch_add(1);
+			}
+			// the newest published frame, or the one of the last call when nothing was published since (empty before any)
+			inline const cv::Mat& Fetch()
+			{
+				if (state.load() & FRESH) front = state.exchange(front) & INDEX;
+				return slots[front];
+			}
+			// number of frames published so far
+			inline uint64_t Generation() const { return generation.load(); }
+
+		private:
+			enum { INDEX = 3, FRESH = 4 };
+			cv::Mat slots[3];
+			std::atomic<int> state;	// the slot between the two sides, plus FRESH while it holds an unfetched frame
+			int back, front;		// the slots owned by the writer and the reader
+			std::atomic<uint64_t> generation;
+		};
 	}
 }
\ No newline at end of file
@@ -1,14 +1,19 @@
 #include <opencv2/highgui.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "ArUcoMarker/ArUcoMarker.h"
 #include "DR/Siltanen/Siltanen.h"
 #include "DR/PixMix/PixMixMarkerHiding.h"
+#include "DR/PixMix/PixMixScheduler.h"
 #include "DR/KawaiViz/MtMarkerHiding.h"
 #include "CameraCalibration/Calibration.h"
 
 void RunSiltanen(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs);
-void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs);
-void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs);
+void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs, const cv::String& kfLoad, const cv::String& kfSave, int rectSize, double budgetMs, double resetBudgetMs);
+void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs, int sliceUs);
+void RunBenchmark();
 
 int main(int argc, char** argv) try
 {
@@ -18,7 +23,13 @@ int main(int argc, char** argv) try
 		"{help h||Show help command}"
 		"{id|0|USB camera ID}"
 		"{xml_name xn|../../data/ip.xml|Input XML file name}"
-		"{method m|s|s: Siltanen, p: PixMix, m: Multi-threading}";
+		"{method m|s|s: Siltanen, p: PixMix, m: Multi-threading, b: Benchmark (no camera)}"
+		"{kf_load kl||Keyframe files loaded at start (glob pattern, PixMix)}"
+		"{kf_save ks|keyframe_|Base name of the keyframe files saved by [s] (PixMix)}"
+		"{rect_size rs|0|Side of the rectified marker-centred image PixMix runs on (0: camera image, PixMix)}"
+		"{slice_us su|0|Time slice of the solver in every frame in microseconds (0: background thread, Multi-threading)}"
+		"{budget_ms bm|0|Per-frame latency target in milliseconds the solver parameters are tuned to (0: fixed parameters, PixMix)}"
+		"{reset_budget_ms rb|0|Latency target of [r] in milliseconds the reset and refresh parameters are tuned to (0: fixed parameters, PixMix)}";
 	cv::String about = "Copyright Shohei Mori";
 	cv::CommandLineParser parser(argc, argv, keys);
 	
@@ -31,12 +42,24 @@ int main(int argc, char** argv) try
 	auto cameraID = parser.get<int>("id");
 	auto xmlName = parser.get<cv::String>("xml_name");
 	auto method = parser.get<cv::String>("method");
+	auto kfLoad = parser.get<cv::String>("kf_load");
+	auto kfSave = parser.get<cv::String>("kf_save");
+	auto rectSize = parser.get<int>("rect_size");
+	auto sliceUs = parser.get<int>("slice_us");
+	auto budgetMs = parser.get<double>("budget_ms");
+	auto resetBudgetMs = parser.get<double>("reset_budget_ms");
 
 	std::cout << "[DRMain] Input summary" << std::endl;
 	std::cout << " - Camera ID: " << cameraID << std::endl;
 	std::cout << " - Input XML name: " << xmlName << std::endl;
 	std::cout << " - Method: " << method << std::endl;
 
+	if (method == "b")
+	{
+		RunBenchmark();
+		return 0;
+	}
+
 	cv::Size imageSize;
 	cv::Mat cameraMatrix, distCoeffs;
 	io::ReadIntrinsics(std::string(xmlName), imageSize, cameraMatrix, distCoeffs);
@@ -55,8 +78,8 @@ int main(int argc, char** argv) try
 	ArUcoMarker marker(23, 0.036f, 0.02f);
 
 	if (method == "s") RunSiltanen(cam, marker, cameraMatrix, distCoeffs);
-	else if (method == "p") RunPixMixMarkerHiding(cam, marker, cameraMatrix, distCoeffs);
-	else if (method == "m") RunMtMarkerHiding(cam, marker, cameraMatrix, distCoeffs);
+	else if (method == "p") RunPixMixMarkerHiding(cam, marker, cameraMatrix, distCoeffs, kfLoad, kfSave, rectSize, budgetMs, resetBudgetMs);
+	else if (method == "m") RunMtMarkerHiding(cam, marker, cameraMatrix, distCoeffs, sliceUs);
 	else std::cerr << "[main] Method " << method << " is not found!" << std::endl;
 
 	return 0;
@@ -95,9 +118,45 @@ void RunSiltanen(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray came
 	}
 }
 
-void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs)
+void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs, const cv::String& kfLoad, const cv::String& kfSave, int rectSize, double budgetMs, double resetBudgetMs)
 {
-	dr::PixMixMarkerHiding pmMk(marker, true);
+	dr::det::PixMixParams resetParams;
+	resetParams.alpha = 0.5f;
+	resetParams.maxItr = 10;
+	resetParams.minChangeRatio = 0.01f;
+	resetParams.annSeed = true;
+
+	dr::det::PixMixMarkerHidingParams mhParams;
+	mhParams.refreshParams = resetParams;
+	mhParams.temporal = true;
+	mhParams.staticMotion = 0.25f;
+	mhParams.rectSize = rectSize;
+	dr::PixMixMarkerHiding pmMk(marker, true, mhParams);
+
+	dr::det::PixMixParams params;
+	params.alpha = 0.0f;
+	params.maxItr = 1;
+	dr::det::PixMixBudget budget;
+	budget.targetMs = budgetMs;
+	dr::PixMixScheduler scheduler(budget, params, rectSize);
+
+	// Reset stalls the frame loop for a whole pyramid run (so do the refreshes of [f] on their thread);
+	// its parameters, maxPyrmLv among them, are tuned after every Reset
+	dr::det::PixMixBudget resetBudget;
+	resetBudget.targetMs = resetBudgetMs;
+	resetBudget.smoothing = 1.0f;
+	resetBudget.downFrames = 1;
+	resetBudget.settleFrames = 1;
+	resetBudget.maxItr = resetParams.maxItr;
+	resetBudget.maxPyrmLv = resetParams.maxPyrmLv;
+	dr::PixMixScheduler resetScheduler(resetBudget, resetParams);
+	if (!kfLoad.empty())
+	{
+		// pre-baked keyframes: hiding starts on the first frame
+		std::vector<cv::String> kfFiles;
+		cv::glob(kfLoad, kfFiles);
+		pmMk.LoadKeyframes(std::vector<std::string>(kfFiles.begin(), kfFiles.end()));
+	}
 
 	const std::string wndName("DR View");
 	char key = -1;
@@ -105,28 +164,44 @@ void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::Input
 	{
 		cv::Mat color, inpainted, viz;
 		cam >> color;
+		cv::TickMeter frameTime;
+		frameTime.start();
 
 		std::vector<cv::Point2f> corners;
+		cv::Vec3d rvec, tvec;
 		marker.DetectMarkers(color);
 		marker.EstimatePoseSingleMarkers(cameraMatrix, distCoeffs);
 		marker.GetCorners(corners);
+		const bool hasPose = marker.GetPose(rvec, tvec);
 
 		// inpainting
-		if (corners.size() > 0 && key == 'r' /* r (reset) key*/)
+		if (corners.size() > 0 && hasPose && key == 'r' /* r (reset) key*/)
 		{
-			dr::det::PixMixParams params;
-			params.alpha = 0.5f;
-			params.maxItr = 10;
-
-			pmMk.Reset(color, corners, params);
+			pmMk.Reset(color, corners, rvec, tvec, resetParams);
+
+			frameTime.stop();
+			const auto& pm = pmMk.GetPixMix();
+			if (resetBudgetMs > 0.0 && resetScheduler.Update(frameTime.getTimeMilli(), pm.GetLvTimes(), pm.GetUsedItrs(), pmMk.LastMeanCost()))
+			{
+				std::cout << "[RunPixMixMarkerHiding] Reset " << resetScheduler.LastDecision() << std::endl;
+				resetParams = resetScheduler.Params();
+			}
 		}
-		else if (corners.size() > 0 && pmMk.IsInitiated())
+		else if (corners.size() > 0 && hasPose && pmMk.IsInitiated())
 		{
-			dr::det::PixMixParams params;
-			params.alpha = 0.0f;
-			params.maxItr = 1;
-
-			pmMk.Run(color, inpainted, corners, params);
+			if (key == 'f' /* f (refresh) key */) pmMk.RequestRefresh(color, corners, rvec, tvec, resetParams);
+			if (key == 's' /* s (save) key */) pmMk.SaveKeyframes(kfSave);
+			pmMk.Run(color, inpainted, corners, rvec, tvec, params);
+
+			// quality scheduling on the frames that ran the solver (the gated ones tell nothing about its cost)
+			frameTime.stop();
+			const auto& pm = pmMk.GetPixMix();
+			if (budgetMs > 0.0 && pmMk.Solved() && scheduler.Update(frameTime.getTimeMilli(), pm.GetLvTimes(), pm.GetUsedItrs(), pmMk.LastMeanCost()))
+			{
+				std::cout << "[RunPixMixMarkerHiding] " << scheduler.LastDecision() << std::endl;
+				params = scheduler.Params();
+				pmMk.SetRectSize(scheduler.RectSize());
+			}
 		}
 
 		if (!inpainted.empty())
@@ -137,14 +212,14 @@ void RunPixMixMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::Input
 		{
 			viz = color.clone();
 		}
-		cv::putText(viz, cv::String("[r] rest, [esc] to exit"), cv::Point(15, 25), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255, 0, 255));
+		cv::putText(viz, cv::String("[r] rest, [f] background refresh, [s] save keyframes, [esc] to exit"), cv::Point(15, 25), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255, 0, 255));
 		cv::imshow(wndName, viz);
 
 		key = cv::waitKey(1);
 	}
 }
 
-void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs)
+void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArray cameraMatrix, cv::InputArray distCoeffs, int sliceUs)
 {
 	dr::MtMarkerHiding pmMtMk(marker, 128, 768, true);
 	
@@ -152,7 +227,7 @@ void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArra
 	char key = -1;
 	while (key != 27 /* escape key */)
 	{
-		cv::Mat color, inpainted, intermidColor, viz;
+		cv::Mat color, intermidColor, viz;
 		cam >> color;
 
 		std::vector<cv::Point2f> corners;
@@ -167,8 +242,11 @@ void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArra
 			params.alpha = 0.5f;
 			params.maxItr = 20;
 			params.maxRandSearchItr = 20;
-			pmMtMk.Run(color, corners, inpainted, params);
+			params.minChangeRatio = 0.01f;
+			if (sliceUs > 0) pmMtMk.BeginSteps(color, corners, params);
+			else pmMtMk.Run(color, corners, params);
 		}
+		if (sliceUs > 0) pmMtMk.Step(std::chrono::microseconds(sliceUs));
 
 		if (corners.size() > 0 && pmMtMk.GetIntermidColor(color, intermidColor, corners))
 		{
@@ -186,4 +264,133 @@ void RunMtMarkerHiding(cv::VideoCapture& cam, ArUcoMarker& marker, cv::InputArra
 	}
 
 	pmMtMk.Stop();
+}
+
+void RunBenchmark()
+{
+	const std::vector<cv::Size> sizes = { cv::Size(640, 480), cv::Size(1920, 1080) };
+#ifdef _OPENMP
+	const int maxThreads = omp_get_max_threads();
+#else
+	const int maxThreads = 1;
+#endif
+
+	dr::det::PixMixParams params;
+	params.alpha = 0.5f;
+	params.maxItr = 5;
+	params.maxRandSearchItr = 5;
+
+	for (const auto& size : sizes)
+	{
+		// synthetic texture with a marker-like quad hole in the middle
+		cv::Mat3b color(size);
+		cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(255));
+		cv::blur(color, color, cv::Size(9, 9));
+
+		const float hw = size.height * 0.15f;
+		const cv::Point2f center(size.width * 0.5f, size.height * 0.5f);
+		std::vector<cv::Point2f> corners = {
+			center + cv::Point2f(hw, -hw), center + cv::Point2f(hw, hw),
+			center + cv::Point2f(-hw, hw), center + cv::Point2f(-hw, -hw)
+		};
+		cv::Mat mask;
+		dr::util::CreateMaskFromCorners(corners, size, mask);
+
+		std::vector<int> vNumThreads;
+		for (int numThreads = 1; numThreads < maxThreads; numThreads *= 2) vNumThreads.push_back(numThreads);
+		vNumThreads.push_back(maxThreads);
+
+		double baseMs = 0.0;
+		for (const auto numThreads : vNumThreads)
+		{
+#ifdef _OPENMP
+			omp_set_num_threads(numThreads);
+#endif
+			cv::setNumThreads(numThreads);
+
+			dr::PixMix pm;
+			cv::Mat inpainted, nnf, cost;
+			cv::TickMeter tm;
+			tm.start();
+			pm.Run(color, mask, inpainted, nnf, cost, params);
+			tm.stop();
+
+			if (numThreads == 1) baseMs = tm.getTimeMilli();
+			std::cout << "[RunBenchmark] " << size << ", " << numThreads << " thread(s): "
+				<< tm.getTimeMilli() << " ms (x" << baseMs / tm.getTimeMilli() << ")" << std::endl;
+		}
+
+		// per-pass times of the row-parallel passes (util::ParallelRows), on one thread and on all threads
+		const auto timePass = [&](const char* name, const auto& pass)
+		{
+			const int numReps = 20;
+			const int vThreads[2] = { 1, maxThreads };
+			double ms[2];
+			for (int i = 0; i < 2; ++i)
+			{
+#ifdef _OPENMP
+				omp_set_num_threads(vThreads[i]);
+#endif
+				cv::setNumThreads(vThreads[i]);
+				pass();		// warm-up
+				cv::TickMeter tm;
+				tm.start();
+				for (int rep = 0; rep < numReps; ++rep) pass();
+				tm.stop();
+				ms[i] = tm.getTimeMilli() / numReps;
+			}
+			std::cout << "[RunBenchmark] " << size << ", " << name << ": " << ms[0] << " ms (1 thread), "
+				<< ms[1] << " ms (" << maxThreads << " thread(s), x" << ms[0] / ms[1] << ")" << std::endl;
+		};
+		{
+			dr::PixMix pm;
+			cv::Mat inpainted, nnf, cost, nnf32, vizPosMap, blended, warpedColor, warpedNNF, warpedCost;
+			pm.Run(color, mask, inpainted, nnf, cost, params);
+
+			auto noSweepParams = params;
+			noSweepParams.maxItr = 0;
+			dr::det::OneLvPixMix lv;
+			lv.Init(color, mask, params.seed, 0);
+			timePass("Inpaint", [&] { lv.Run(noSweepParams); });
+			timePass("pyramid without sweeps (BuildPyrm, Inpaint, FillInLowerLv, BlendBorder)", [&] { pm.Run(color, mask, inpainted, nnf, cost, noSweepParams); });
+			const cv::Rect hole = cv::boundingRect(mask != 255);	// known to PixMix from the mask indices
+			timePass("BlendBorder", [&] { dr::util::BlendBorder(color, mask, inpainted, params.blurSize, blended, hole); });
+
+			// the keyframe seen from corners moved by a few pixels
+			const cv::Rect roi = cv::boundingRect(corners) & cv::Rect(cv::Point(0, 0), size);
+			dr::det::PixMixKeyframe kf;
+			kf.Set(inpainted(roi), mask(roi), nnf(roi), cost(roi), corners, roi);
+			std::vector<cv::Point2f> movedCorners = corners;
+			for (auto& corner : movedCorners) corner += cv::Point2f(3.0f, 2.0f);
+			timePass("PixMixKeyframe::GetWarped", [&] { kf.GetWarped(movedCorners, roi, warpedColor, warpedNNF, warpedCost); });
+
+			dr::det::DecodePosMap(nnf, nnf32);
+			timePass("CreateVizPosMap", [&] { dr::util::CreateVizPosMap(nnf32, vizPosMap); });
+		}
+
+		// cost-vs-time curves of the random search modes (all threads)
+		for (const auto mode : { dr::det::RAND_SEARCH_GLOBAL, dr::det::RAND_SEARCH_LOCAL })
+		{
+			for (int maxItr = 1; maxItr <= 8; maxItr *= 2)
+			{
+				auto searchParams = params;
+				searchParams.randSearchMode = mode;
+				searchParams.maxItr = maxItr;
+
+				dr::PixMix pm;
+				cv::Mat inpainted, nnf, cost;
+				cv::TickMeter tm;
+				tm.start();
+				pm.Run(color, mask, inpainted, nnf, cost, searchParams);
+				tm.stop();
+
+				// the compact cost map holds 16-bit codes; the mean is taken over the decoded [0, 1] costs
+				cv::Mat costF;
+				dr::det::DecodeCostMap(cost, costF);
+				std::cout << "[RunBenchmark] " << size << ", " << (mode == dr::det::RAND_SEARCH_LOCAL ? "local" : "global")
+					<< " search, " << maxItr << " iteration(s): " << tm.getTimeMilli() << " ms, mean cost "
+					<< cv::mean(costF, mask == 0)[0] << std::endl;
+			}
+		}
+	}
 }
\ No newline at end of file